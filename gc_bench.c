@@ -0,0 +1,388 @@
+// Benchmarks for the allocator and collector in main.c.
+//
+//   gcc -O2 -pthread -o gc_bench gc_bench.c -ldl
+//   ./gc_bench
+//
+// main.c is compiled into this file with its demo renamed, so the
+// benchmark uses the same malloc/free and gc() as programs linked with it.
+
+#define main gc_demo_main
+#include "main.c"
+#undef main
+
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#define CHASE_BYTES (64UL << 20) // Pointer chase buffer, well past the LLC
+#define CHASE_STEPS 4000000
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Counter of data TLB load misses in this thread, or -1 if perf events
+// are unavailable (no PMU, or perf_event_paranoid forbids it)
+static int open_tlb_counter(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Pin the calling thread to the CPUs of `node` (from nodeN/cpulist)
+static int pin_to_node(int node) {
+  char path[64], buf[256];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  char *p = buf;
+  while (*p >= '0' && *p <= '9') {
+    long first = strtol(p, &p, 10), last = first;
+    if (*p == '-')
+      last = strtol(p + 1, &p, 10);
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &set);
+    if (*p == ',')
+      p++;
+  }
+  return sched_setaffinity(0, sizeof(set), &set);
+}
+
+// ns per dependent load over a random cycle in memory bound to `mem_node`
+static double chase(int mem_node) {
+  size_t slots = CHASE_BYTES / sizeof(void *);
+  void **buf = mmap(NULL, CHASE_BYTES, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    return -1;
+  unsigned long mask = 1UL << mem_node;
+  syscall(SYS_mbind, buf, CHASE_BYTES, 2 /* MPOL_BIND */, &mask,
+          sizeof(mask) * 8, 0);
+
+  // One cycle through every slot, in a shuffled order
+  size_t *order = mmap(NULL, slots * sizeof(size_t), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  for (size_t i = 0; i < slots; i++)
+    order[i] = i;
+  uint64_t seed = 88172645463325252ULL;
+  for (size_t i = slots - 1; i > 0; i--) {
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    size_t j = seed % (i + 1), t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  for (size_t i = 0; i < slots; i++)
+    buf[order[i]] = &buf[order[(i + 1) % slots]];
+  munmap(order, slots * sizeof(size_t));
+
+  void **p = &buf[0];
+  double start = now_ns();
+  for (int i = 0; i < CHASE_STEPS; i++)
+    p = *p;
+  double ns = (now_ns() - start) / CHASE_STEPS;
+  __asm__ volatile("" : : "r"(p));
+
+  munmap(buf, CHASE_BYTES);
+  return ns;
+}
+
+// Local vs remote latency: every CPU node against every memory node
+static void bench_numa(void) {
+  int nodes = read_online_nodes();
+  if (nodes < 1)
+    nodes = 1;
+  printf("NUMA access latency, ns per load (%d node%s)\n", nodes,
+         nodes > 1 ? "s" : "");
+  printf("  cpu\\mem");
+  for (int m = 0; m < nodes; m++)
+    printf("  node%-4d", m);
+  printf("\n");
+
+  for (int c = 0; c < nodes; c++) {
+    if (pin_to_node(c) != 0)
+      continue;
+    printf("  node%-3d", c);
+    for (int m = 0; m < nodes; m++)
+      printf("  %-8.1f", chase(m));
+    printf("\n");
+  }
+}
+
+struct bench_node {
+  struct bench_node *next;
+  long payload;
+};
+
+// Collection time and TLB misses over a linked heap of small objects built
+// on this node, with or without huge-page segments. Runs in a child so
+// each mode starts from an empty heap.
+static void bench_gc(int huge) {
+  if (fork() != 0) {
+    wait(NULL);
+    return;
+  }
+
+  if (huge && !gc_enable_huge_pages()) {
+    printf("gc() with huge pages: THP disabled\n");
+    exit(0);
+  }
+  gc_enable_numa();
+  struct bench_node *volatile head = NULL;
+  for (int i = 0; i < 1000000; i++) {
+    struct bench_node *n = malloc(sizeof(*n));
+    n->next = head;
+    n->payload = i;
+    head = n;
+  }
+
+  int tlb = open_tlb_counter();
+  long long misses = 0;
+  double best = 0;
+  for (int round = 0; round < 5; round++) {
+    long long count = 0;
+    if (tlb >= 0) {
+      ioctl(tlb, PERF_EVENT_IOC_RESET, 0);
+      ioctl(tlb, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = now_ns();
+    gc();
+    double ms = (now_ns() - start) / 1e6;
+    if (tlb >= 0) {
+      ioctl(tlb, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(tlb, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    }
+    if (round == 0 || ms < best) {
+      best = ms;
+      misses = count;
+    }
+  }
+  long live = 0;
+  for (struct bench_node *n = head; n; n = n->next)
+    live++;
+
+  printf("gc() over %ld live small objects, %s pages: %.2f ms (best of 5)",
+         live, huge ? "huge" : "base", best);
+  if (tlb >= 0)
+    printf(", %lld dTLB load misses\n", misses);
+  else
+    printf(", dTLB misses n/a\n");
+  exit(0);
+}
+
+struct mark_node {
+  struct mark_node *edge[4];
+  long payload[4];
+};
+
+// Mark throughput over a random graph of 64-byte objects: each links to
+// the next in a shuffled order, keeping all of them reachable, and to
+// three others at random, so every pointer leads to a cold header and the
+// mark stack always holds work. Headered blocks, or small-page objects
+// with `small`; in a reserved address range with `reserved`. Runs in a
+// child so each heap starts empty.
+static void bench_mark(size_t count, int small, int reserved) {
+  if (fork() != 0) {
+    wait(NULL);
+    return;
+  }
+  if (reserved && gc_reserve_heap((size_t)16 << 30) != 0) {
+    printf("gc_reserve_heap failed\n");
+    exit(1);
+  }
+  if (small)
+    gc_enable_small_pages();
+
+  struct mark_node **nodes =
+      mmap(NULL, count * sizeof(*nodes), PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  double built = now_ns();
+  for (size_t i = 0; i < count; i++)
+    nodes[i] = malloc(sizeof(struct mark_node));
+  built = (now_ns() - built) / 1e6;
+  uint64_t seed = 88172645463325252ULL;
+  for (size_t i = count - 1; i > 0; i--) {
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    size_t j = seed % (i + 1);
+    struct mark_node *t = nodes[i];
+    nodes[i] = nodes[j];
+    nodes[j] = t;
+  }
+  for (size_t i = 0; i < count; i++) {
+    nodes[i]->edge[0] = i + 1 < count ? nodes[i + 1] : NULL;
+    for (int e = 1; e < 4; e++) {
+      seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+      nodes[i]->edge[e] = nodes[seed % count];
+    }
+  }
+  struct mark_node *volatile head = nodes[0];
+  munmap(nodes, count * sizeof(*nodes));
+
+  size_t heap = (size_t)((char *)heap_sbrk(0) - (char *)global_base);
+  double best = 0;
+  for (int round = 0; round < 3; round++) {
+    double start = now_ns();
+    gc();
+    double ms = (now_ns() - start) / 1e6;
+    if (round == 0 || ms < best)
+      best = ms;
+  }
+  printf("gc() over %zu MiB of %s%s: %.0f ms, %.0f MB/s (best of 3); "
+         "allocated in %.0f ms\n",
+         heap >> 20, small ? "small-page objects" : "headered blocks",
+         reserved ? ", reserved" : "", best, heap / 1e6 / (best / 1e3), built);
+  (void)head;
+  exit(0);
+}
+
+#define ROOT_BYTES (256UL << 20)
+
+// Root scanning speed of each range filter kernel: gc() over a small heap
+// with a large registered root range of mostly non-pointer words
+static void bench_filter(void) {
+  if (fork() != 0) {
+    wait(NULL);
+    return;
+  }
+
+  size_t words = ROOT_BYTES / sizeof(uintptr_t);
+  uintptr_t *roots = mmap(NULL, ROOT_BYTES, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  void *volatile live[256];
+  for (int i = 0; i < 256; i++)
+    live[i] = malloc(64);
+  uint64_t seed = 88172645463325252ULL;
+  for (size_t i = 0; i < words; i++) {
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    roots[i] = i % 4096 == 0 ? (uintptr_t)live[seed % 256] : seed >> 16;
+  }
+  gc_add_roots(roots, roots + words);
+
+  struct {
+    const char *name;
+    size_t (*kernel)(const uintptr_t *, size_t, uintptr_t, uintptr_t,
+                     uint16_t *);
+    int usable;
+  } kernels[] = {
+    {"scalar", filter_words_scalar, 1},
+#if defined(__x86_64__)
+    {"sse4.2", filter_words_sse42, __builtin_cpu_supports("sse4.2")},
+    {"avx2", filter_words_avx2, __builtin_cpu_supports("avx2")},
+#endif
+  };
+
+  printf("gc() with a %lu MiB root range:\n", ROOT_BYTES >> 20);
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (!kernels[k].usable)
+      continue;
+    filter_words = kernels[k].kernel;
+    double best = 0;
+    for (int round = 0; round < 5; round++) {
+      double start = now_ns();
+      gc();
+      double ms = (now_ns() - start) / 1e6;
+      if (round == 0 || ms < best)
+        best = ms;
+    }
+    printf("  %-7s %.1f ms, %.0f MB/s (best of 5)\n", kernels[k].name, best,
+           ROOT_BYTES / 1e6 / (best / 1e3));
+  }
+  exit(0);
+}
+
+#define PROFILE_OBJECTS 200000
+#define PROFILE_ROUNDS 20
+
+// ms to allocate mixed 16..256-byte objects, with the heap profiler at its
+// default rate if `on`. Each round runs in a child of its own so both
+// modes start from the same empty heap.
+static double profile_round(int on) {
+  int fds[2];
+  double ms = -1;
+  if (pipe(fds) != 0)
+    return -1;
+  if (fork() != 0) {
+    close(fds[1]);
+    if (read(fds[0], &ms, sizeof(ms)) != sizeof(ms))
+      ms = -1;
+    close(fds[0]);
+    wait(NULL);
+    return ms;
+  }
+
+  // The profiler's table is mapped in both modes: on this kernel any new
+  // mapping slows the page faults that follow by about 5%, which is not
+  // a cost of sampling
+  gc_profile_start(0);
+  if (!on)
+    gc_profile_stop();
+  uint64_t seed = 88172645463325252ULL;
+  double start = now_ns();
+  for (int i = 0; i < PROFILE_OBJECTS; i++) {
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    long *volatile obj = malloc(16 + (seed % 16) * 16);
+    obj[0] = i;
+  }
+  ms = (now_ns() - start) / 1e6;
+  if (write(fds[1], &ms, sizeof(ms)) != sizeof(ms))
+    exit(1);
+  exit(0);
+}
+
+// Heap profiler overhead on allocation: the modes alternate and the best
+// round of each is kept, which filters out most of the noise of a shared
+// machine
+static void bench_profile(void) {
+  double best[2] = {0, 0};
+  for (int round = 0; round < 2 * PROFILE_ROUNDS; round++) {
+    int on = round & 1;
+    double ms = profile_round(on);
+    if (round < 2 || ms < best[on])
+      best[on] = ms;
+  }
+  printf("%d allocations: %.2f ms, %.2f ms with the heap profiler at %d KiB "
+         "(%+.1f%%, best of %d)\n",
+         PROFILE_OBJECTS, best[0], best[1], PROFILE_DEFAULT_RATE >> 10,
+         100.0 * (best[1] - best[0]) / best[0], PROFILE_ROUNDS);
+}
+
+int main(void) {
+  // A static buffer: stdio must not allocate before the reserved heap
+  // benchmarks fork, or there is a heap already and the reservation fails
+  static char out[BUFSIZ];
+  setvbuf(stdout, out, _IOLBF, sizeof(out));
+  gc_init();
+  bench_numa();
+  fflush(stdout);
+  bench_gc(0);
+  bench_gc(1);
+  bench_filter();
+  bench_profile();
+  bench_mark(1 << 20, 0, 0);
+  bench_mark(1 << 20, 0, 1);
+  bench_mark(6 << 20, 1, 0);
+  bench_mark(6 << 20, 1, 1);
+  return 0;
+}
@@ -0,0 +1,344 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Offline reader for snapshots written by gc_heap_snapshot() in main.c.
+//
+//   gcc -O2 -o heap_reader heap_reader.c
+//   ./heap_reader heap.snap               # summary, histogram, fragmentation
+//   ./heap_reader heap.snap 0x5555...     # plus the retention path of a block
+
+// ===== CONFIGURATION =====
+// Must match main.c
+#define SNAPSHOT_MAGIC "GCSNAP01"
+#define SNAPSHOT_VERSION 1
+#define SNAP_BLOCK 1
+#define SNAP_ROOT 2
+#define SNAP_END 3
+
+#define HISTOGRAM_BUCKETS 48 // Power-of-two size classes
+
+// ===== DATA STRUCTURES =====
+struct block {
+  uint64_t addr; // Payload address
+  uint64_t size;
+  int free;
+  int marked;
+  unsigned flags;
+  size_t first_edge; // Range in the edge array
+  size_t edge_count;
+};
+
+struct root {
+  int kind;
+  uint64_t source;
+  size_t target; // Block index
+};
+
+struct snapshot {
+  struct block *blocks;
+  size_t block_count;
+  uint64_t *edges; // Target payload addresses, resolved to indices later
+  size_t edge_count;
+  struct root *roots;
+  size_t root_count;
+};
+
+struct cursor {
+  const unsigned char *p;
+  const unsigned char *end;
+};
+
+static const char *root_kinds[] = {"data", "stack", "registered", "handle"};
+
+// ===== FUNCTIONS =====
+static void die(const char *msg) {
+  fprintf(stderr, "heap_reader: %s\n", msg);
+  exit(1);
+}
+
+static void *grow(void *array, size_t *capacity, size_t count, size_t elem) {
+  if (count < *capacity)
+    return array;
+  *capacity = *capacity ? *capacity * 2 : 1024;
+  array = realloc(array, *capacity * elem);
+  if (!array)
+    die("out of memory");
+  return array;
+}
+
+static unsigned char read_byte(struct cursor *c) {
+  if (c->p >= c->end)
+    die("truncated snapshot");
+  return *c->p++;
+}
+
+static uint64_t read_varint(struct cursor *c) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    unsigned char byte = read_byte(c);
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  die("bad varint");
+  return 0;
+}
+
+static int64_t read_delta(struct cursor *c) {
+  uint64_t v = read_varint(c);
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Index of the block whose payload contains `addr`, or -1
+static long find_block(struct snapshot *snap, uint64_t addr) {
+  size_t lo = 0, hi = snap->block_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (snap->blocks[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return -1;
+  struct block *b = &snap->blocks[lo - 1];
+  return addr < b->addr + b->size ? (long)(lo - 1) : -1;
+}
+
+static void load_snapshot(struct snapshot *snap, const unsigned char *data,
+                          size_t len) {
+  struct cursor c = {data, data + len};
+  size_t block_cap = 0, edge_cap = 0, root_cap = 0;
+  uint64_t prev = 0;
+
+  size_t magic_len = strlen(SNAPSHOT_MAGIC);
+  if (len < magic_len || memcmp(data, SNAPSHOT_MAGIC, magic_len) != 0)
+    die("not a heap snapshot");
+  c.p += magic_len;
+
+  if (read_varint(&c) != SNAPSHOT_VERSION)
+    die("unsupported snapshot version");
+  read_varint(&c); // Word size
+  read_varint(&c); // Heap base
+
+  for (;;) {
+    int tag = read_byte(&c);
+
+    if (tag == SNAP_BLOCK) {
+      snap->blocks = grow(snap->blocks, &block_cap, snap->block_count,
+                          sizeof(struct block));
+      struct block *b = &snap->blocks[snap->block_count++];
+      b->addr = prev + read_varint(&c);
+      b->size = read_varint(&c);
+      int state = read_byte(&c);
+      b->free = state & 1;
+      b->marked = (state >> 1) & 1;
+      b->flags = (unsigned)read_varint(&c);
+      b->first_edge = snap->edge_count;
+
+      uint64_t chunk;
+      while ((chunk = read_varint(&c)) != 0) {
+        for (uint64_t i = 0; i < chunk; i++) {
+          snap->edges = grow(snap->edges, &edge_cap, snap->edge_count,
+                             sizeof(uint64_t));
+          snap->edges[snap->edge_count++] = b->addr + read_delta(&c);
+        }
+      }
+      b->edge_count = snap->edge_count - b->first_edge;
+      prev = b->addr;
+    } else if (tag == SNAP_ROOT) {
+      snap->roots = grow(snap->roots, &root_cap, snap->root_count,
+                         sizeof(struct root));
+      struct root *r = &snap->roots[snap->root_count++];
+      r->kind = read_byte(&c);
+      r->source = read_varint(&c);
+      r->target = (size_t)read_varint(&c); // Address until resolved
+    } else if (tag == SNAP_END) {
+      if (read_varint(&c) != snap->block_count ||
+          read_varint(&c) != snap->root_count)
+        die("record counts do not match");
+      break;
+    } else {
+      die("unknown record");
+    }
+  }
+
+  // Resolve addresses to block indices (blocks are in address order)
+  for (size_t i = 0; i < snap->edge_count; i++) {
+    snap->edges[i] = (uint64_t)find_block(snap, snap->edges[i]);
+  }
+  for (size_t i = 0; i < snap->root_count; i++) {
+    snap->roots[i].target = (size_t)find_block(snap, snap->roots[i].target);
+  }
+}
+
+static void print_summary(struct snapshot *snap) {
+  size_t used = 0, free_count = 0;
+  uint64_t used_bytes = 0, free_bytes = 0, largest_free = 0;
+
+  for (size_t i = 0; i < snap->block_count; i++) {
+    struct block *b = &snap->blocks[i];
+    if (b->free) {
+      free_count++;
+      free_bytes += b->size;
+      if (b->size > largest_free)
+        largest_free = b->size;
+    } else {
+      used++;
+      used_bytes += b->size;
+    }
+  }
+
+  printf("Blocks: %zu allocated (%llu bytes), %zu free (%llu bytes)\n", used,
+         (unsigned long long)used_bytes, free_count,
+         (unsigned long long)free_bytes);
+  printf("Pointers: %zu edges, %zu root references\n", snap->edge_count,
+         snap->root_count);
+
+  printf("\n[FRAGMENTATION]\n");
+  printf("Largest free block: %llu bytes\n", (unsigned long long)largest_free);
+  printf("Fragmentation: %.3f (1 - largest free / total free)\n",
+         free_bytes ? 1.0 - (double)largest_free / (double)free_bytes : 0.0);
+  printf("Free share of heap: %.1f%%\n",
+         used_bytes + free_bytes
+             ? 100.0 * (double)free_bytes / (double)(used_bytes + free_bytes)
+             : 0.0);
+}
+
+static void print_histogram(struct snapshot *snap) {
+  uint64_t counts[HISTOGRAM_BUCKETS][2] = {{0}};
+  uint64_t bytes[HISTOGRAM_BUCKETS][2] = {{0}};
+
+  for (size_t i = 0; i < snap->block_count; i++) {
+    struct block *b = &snap->blocks[i];
+    int bucket = b->size ? 63 - __builtin_clzll(b->size) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+      bucket = HISTOGRAM_BUCKETS - 1;
+    counts[bucket][b->free]++;
+    bytes[bucket][b->free] += b->size;
+  }
+
+  printf("\n[SIZE HISTOGRAM]\n");
+  printf("%-22s %-12s %-14s %-12s %-14s\n", "Size", "Allocated", "Bytes",
+         "Free", "Bytes");
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (!counts[i][0] && !counts[i][1])
+      continue;
+    char range[64];
+    snprintf(range, sizeof(range), "[%llu, %llu)", 1ull << i, 1ull << (i + 1));
+    printf("%-22s %-12llu %-14llu %-12llu %-14llu\n", range,
+           (unsigned long long)counts[i][0], (unsigned long long)bytes[i][0],
+           (unsigned long long)counts[i][1], (unsigned long long)bytes[i][1]);
+  }
+}
+
+// Breadth-first search from all roots, so the printed path is a shortest one
+static void print_retention_path(struct snapshot *snap, uint64_t addr) {
+  long target = find_block(snap, addr);
+  printf("\n[RETENTION PATH of 0x%llx]\n", (unsigned long long)addr);
+  if (target < 0 || snap->blocks[target].free) {
+    printf("  not an allocated block\n");
+    return;
+  }
+
+  long *parent = malloc(snap->block_count * sizeof(long));
+  size_t *queue = malloc(snap->block_count * sizeof(size_t));
+  long *via_root = malloc(snap->block_count * sizeof(long));
+  if (!parent || !queue || !via_root)
+    die("out of memory");
+  for (size_t i = 0; i < snap->block_count; i++) {
+    parent[i] = -2; // Unvisited
+    via_root[i] = -1;
+  }
+
+  size_t head = 0, tail = 0;
+  for (size_t i = 0; i < snap->root_count; i++) {
+    size_t t = snap->roots[i].target;
+    if (t == (size_t)-1 || parent[t] != -2)
+      continue;
+    parent[t] = -1;
+    via_root[t] = (long)i;
+    queue[tail++] = t;
+  }
+
+  while (head < tail && parent[target] == -2) {
+    size_t b = queue[head++];
+    struct block *blk = &snap->blocks[b];
+    for (size_t e = 0; e < blk->edge_count; e++) {
+      uint64_t t = snap->edges[blk->first_edge + e];
+      if (t == (uint64_t)-1 || parent[t] != -2)
+        continue;
+      parent[t] = (long)b;
+      queue[tail++] = (size_t)t;
+    }
+  }
+
+  if (parent[target] == -2) {
+    printf("  unreachable (garbage, or snapshot taken without pointers)\n");
+  } else {
+    // Walk back to the root, then print root first
+    size_t depth = 0;
+    for (long b = target; b >= 0; b = parent[b])
+      queue[depth++] = (size_t)b;
+
+    struct root *r = &snap->roots[via_root[queue[depth - 1]]];
+    printf("  %s root at 0x%llx\n",
+           r->kind < 4 ? root_kinds[r->kind] : "unknown",
+           (unsigned long long)r->source);
+    while (depth-- > 0) {
+      struct block *b = &snap->blocks[queue[depth]];
+      printf("  -> 0x%llx (%llu bytes)\n", (unsigned long long)b->addr,
+             (unsigned long long)b->size);
+    }
+  }
+
+  free(parent);
+  free(queue);
+  free(via_root);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s SNAPSHOT [BLOCK_ADDRESS...]\n", argv[0]);
+    return 2;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "heap_reader: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+    die("cannot read snapshot size");
+
+  // Map the whole file: the parser is a single sequential pass
+  unsigned char *data =
+      mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    die("cannot map snapshot");
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  struct snapshot snap = {0};
+  load_snapshot(&snap, data, (size_t)st.st_size);
+  munmap(data, (size_t)st.st_size);
+  close(fd);
+
+  print_summary(&snap);
+  print_histogram(&snap);
+  for (int i = 2; i < argc; i++) {
+    print_retention_path(&snap, strtoull(argv[i], NULL, 0));
+  }
+
+  free(snap.blocks);
+  free(snap.edges);
+  free(snap.roots);
+  return 0;
+}
@@ -1,47 +1,613 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <iso646.h>
+#include <link.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // ===== CONFIGURATION =====
 #define META_SIZE sizeof(struct block_meta)
 #define MIN_SIZE 8 // Minimum block size for splitting
+#define MAX_ROOT_RANGES 4096 // Capacity of the registered root table
+#define MAX_DATA_SEGMENTS 256 // Writable segments of all loaded modules
+#define MAX_DESCRIPTORS 256   // Distinct registered pointer layouts
+
+// Blacklisting: heap pages hit by non-pointer roots are avoided for large
+// blocks, so an integer that looks like an address cannot pin a big block
+#define BLACKLIST_PAGE_SHIFT 12
+#define BLACKLIST_PAGE_SIZE ((uintptr_t)1 << BLACKLIST_PAGE_SHIFT)
+#define BLACKLIST_BITS (1 << 16)       // Pages tracked per table (hashed)
+#define BLACKLIST_MIN_SIZE 4096        // Only blocks this large avoid hits
+#define BLACKLIST_LOOKAHEAD (1 << 20)  // Also watch this far above the break
+#define BLACKLIST_MAX_SKIPS 16         // Then a large block takes its hits
+
+// Block flags
+#define BLOCK_ATOMIC 0x1   // Contents never hold pointers: not scanned by GC
+#define BLOCK_INTERIOR 0x2 // Interior pointers keep it alive in any policy
+#define BLOCK_OLD 0x4      // Promoted: minor collections treat it as live
+#define BLOCK_PROMOTED 0x8 // Promoted by the collection in progress
+#define BLOCK_TLAB 0x10    // Free remainder of a thread's allocation buffer
+#define BLOCK_PINNED 0x20  // Hit by an ambiguous reference: gc_compact keeps it
+#define BLOCK_FINALIZABLE 0x40 // Has an entry in the finalizer table
+#define BLOCK_SAMPLED 0x80 // Recorded by the heap profiler
+#define BLOCK_TYPE_FLAGS (BLOCK_ATOMIC | BLOCK_INTERIOR) // Kept by realloc
+#define BLOCK_AGE_SHIFT 8  // Minor collections survived while young
+#define BLOCK_AGE_MAX 0x3f
+#define BLOCK_AGE(b) (((b)->flags >> BLOCK_AGE_SHIFT) & BLOCK_AGE_MAX)
+#define BLOCK_POOL 0x4000     // Object of a gc_pool slab
+#define BLOCK_RELEASED 0x8000 // Free block whose inner pages were madvised
+#define BLOCK_UNSHARED (BLOCK_TLAB | BLOCK_POOL) // Free but owned: no reuse
+#define BLOCK_SAMPLE_SHIFT 16 // Sample table index of a BLOCK_SAMPLED block
+#define BLOCK_SAMPLE(b) ((unsigned)(b)->flags >> BLOCK_SAMPLE_SHIFT)
+#define BLOCK_SAMPLE_BITS (BLOCK_SAMPLED | (0x7fff << BLOCK_SAMPLE_SHIFT))
+
+// Generational mode (gc_enable_generational)
+#define MARK_STACK_INITIAL 4096       // Entries; grows with mremap
+#define MARK_PREFETCH_DEPTH 16        // Candidates in flight in scan_heap
+#define FILTER_CHUNK 256              // Words range-checked per filter call
+#define MAX_REMEMBERED 65536          // Old-to-young slots between cycles
+#define DEFAULT_PROMOTE_AGE 2         // Minor cycles survived before tenure
+#define DEFAULT_FULL_GROWTH (8 << 20) // Old bytes promoted before a full GC
+
+// Thread-local allocation buffers: small requests bump through a chunk
+#define TLAB_MAX_OBJECT 256 // Larger requests use the free list
+#define TLAB_SIZE (32 << 10) // Chunk taken from the top of the heap
+#define TLAB_MIN_REFILL 2048 // Smallest free hole worth reusing as a TLAB
+
+// Free space at the top of the heap beyond this is given back with a
+// negative sbrk after free() and every sweep (gc_set_trim_threshold)
+#define DEFAULT_TRIM_THRESHOLD (128 << 10)
+
+// Scavenger: after each collection, whole pages inside large free blocks
+// are returned with madvise until at most `target` free bytes stay
+// resident, releasing no more than a batch per cycle
+#define SCAVENGE_MIN_SIZE (64 << 10)       // Smaller free blocks are kept
+#define SCAVENGE_BATCH (8 << 20)           // Bytes released per collection
+#define DEFAULT_SCAVENGE_TARGET (16 << 20) // gc_set_scavenge_target
+
+// Huge-page mode (gc_enable_huge_pages): the break only ever moves in
+// whole, aligned huge pages, advised with MADV_HUGEPAGE, and trimming and
+// the scavenger give memory back in the same unit so none is split
+#define HUGE_PAGE_SIZE ((uintptr_t)2 << 20)
+
+// Reserved heap (gc_reserve_heap): one PROT_NONE range mapped up front.
+// The break moves inside it, committed a chunk at a time, and a granule
+// index over it replaces the binary search for interior pointers.
+#define COMMIT_CHUNK ((uintptr_t)1 << 20)
+#define GRANULE_SHIFT 9 // Heap bytes per granule index entry: 512
+
+// Small-object pages (gc_enable_small_pages): requests up to SMALL_MAX
+// bytes come from 64 KiB pages of one size class, with no block header per
+// object. A page is a single heap block aligned so its payload starts on a
+// SMALL_PAGE_SIZE boundary, where its metadata lives.
+#define SMALL_PAGE_SHIFT 16
+#define SMALL_PAGE_SIZE ((uintptr_t)1 << SMALL_PAGE_SHIFT)
+#define SMALL_GRANULE 16 // Class sizes are multiples of this
+#define SMALL_MAX 256
+#define SMALL_CLASSES (SMALL_MAX / SMALL_GRANULE)
+#define SMALL_BITMAP_WORDS (SMALL_PAGE_SIZE / SMALL_GRANULE / 64)
+#define SMALL_MAP_SPAN ((uintptr_t)64 << 30) // Heap range the page map covers
+#define SMALL_PAGE_MAGIC 0x44444444 // Magic of a block that holds a page
+
+// NUMA placement of small pages (gc_enable_numa). mbind is called through
+// syscall(), so libnuma is not needed.
+#define MAX_NUMA_NODES 8
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// Object pools (gc_pool_create): slabs of equal blocks, never merged
+#define MAX_POOLS 256
+#define POOL_SLAB_SIZE (64 << 10) // Bytes of objects carved per slab
+#define POOL_FREE_MAGIC 0x33333333 // Free and on its pool's free list
+
+// Regions (gc_region_begin): bump allocation in chunks that die together
+#define MAX_REGIONS 1024
+#define REGION_CHUNK_SIZE (64 << 10)
+#define REGION_CACHE 64 // Released chunks kept for reuse until the next gc()
+
+#define MAX_HANDLES 65536 // Precise roots from gc_new_handle
+#define MAX_FINALIZERS 65536 // Registered plus queued finalizers
+#define MAX_WEAK 65536       // Weak references plus disappearing links
+
+// Sampling heap profiler (gc_profile_start): on average one allocation per
+// `rate` bytes is recorded with its call stack, found by walking frame
+// pointers. Build with -fno-omit-frame-pointer for full stacks.
+#define PROFILE_DEFAULT_RATE (512 << 10)
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_MAX_FRAME (1 << 20) // Larger frame steps end the walk
+#define MAX_SAMPLES 32768 // Live sampled blocks (index fits in the flags)
+#define GC_PROFILE_PPROF 0  // Legacy pprof heap profile (`pprof prog file`)
+#define GC_PROFILE_FOLDED 1 // Collapsed stacks for flamegraph.pl
+
+// Hidden pointers are invisible to conservative scanning, so a slot holding
+// one does not keep its object alive
+#define GC_HIDE_POINTER(p) (~(uintptr_t)(p))
+#define GC_REVEAL_POINTER(h) ((void *)~(uintptr_t)(h))
+
+// Heap snapshot format (gc_heap_snapshot, read by heap_reader.c). After the
+// magic and a varint header, records are tagged; integers are LEB128
+// varints and addresses are deltas, so a record is usually under 8 bytes.
+#define SNAPSHOT_MAGIC "GCSNAP01"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BUFFER (1 << 20) // Bytes staged per write()
+#define SNAP_BLOCK 1 // delta addr, size, state, flags, pointer chunks
+#define SNAP_ROOT 2  // kind, source address, target block
+#define SNAP_END 3   // block count, root count
+#define SNAP_ROOT_DATA 0
+#define SNAP_ROOT_STACK 1
+#define SNAP_ROOT_REGISTERED 2
+#define SNAP_ROOT_HANDLE 3
+
+// Which addresses count as a reference to a block (gc_set_interior_policy)
+#define GC_INTERIOR_ALL 0    // Anywhere inside the payload (default)
+#define GC_INTERIOR_WINDOW 1 // Payload start up to a small offset window
+#define GC_INTERIOR_BASE 2   // Exactly the payload start
+
+#define WORD_ALIGN_DOWN(x) ((x) & ~(uintptr_t)(sizeof(uintptr_t) - 1))
+#define WORD_ALIGN_UP(x) WORD_ALIGN_DOWN((x) + sizeof(uintptr_t) - 1)
 
 // ===== DATA STRUCTURES =====
+// Pointer layout of a type: bit i of `bitmap` set means word i holds a
+// pointer. Blocks larger than `words` repeat the layout (arrays of the type).
+struct gc_descriptor {
+  size_t words;
+  uintptr_t bitmap;
+};
+
 struct block_meta {
   size_t size;
   struct block_meta *next;
   int free;
   int marked; // For garbage collection
   int magic;  // For debugging (detects corruption)
+  int flags;  // BLOCK_* bits (fits in the struct's tail padding)
+  const struct gc_descriptor *descr; // NULL: scan conservatively
+};
+
+// Build a descriptor from a struct and the names of its pointer fields:
+//   static const struct gc_descriptor *node_descr;
+//   node_descr = GC_DESCRIPTOR(struct node, left, right);
+#define GC_PTR_BIT(type, field)                                                \
+  ((uintptr_t)1 << (offsetof(type, field) / sizeof(uintptr_t)))
+#define GC_BITS_1(t, a) GC_PTR_BIT(t, a)
+#define GC_BITS_2(t, a, ...) (GC_PTR_BIT(t, a) | GC_BITS_1(t, __VA_ARGS__))
+#define GC_BITS_3(t, a, ...) (GC_PTR_BIT(t, a) | GC_BITS_2(t, __VA_ARGS__))
+#define GC_BITS_4(t, a, ...) (GC_PTR_BIT(t, a) | GC_BITS_3(t, __VA_ARGS__))
+#define GC_BITS_5(t, a, ...) (GC_PTR_BIT(t, a) | GC_BITS_4(t, __VA_ARGS__))
+#define GC_BITS_6(t, a, ...) (GC_PTR_BIT(t, a) | GC_BITS_5(t, __VA_ARGS__))
+#define GC_BITS_7(t, a, ...) (GC_PTR_BIT(t, a) | GC_BITS_6(t, __VA_ARGS__))
+#define GC_BITS_8(t, a, ...) (GC_PTR_BIT(t, a) | GC_BITS_7(t, __VA_ARGS__))
+#define GC_NARGS(...) GC_NARGS_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define GC_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define GC_CAT(a, b) GC_CAT_(a, b)
+#define GC_CAT_(a, b) a##b
+#define GC_POINTER_BITMAP(type, ...)                                           \
+  GC_CAT(GC_BITS_, GC_NARGS(__VA_ARGS__))(type, __VA_ARGS__)
+#define GC_DESCRIPTOR(type, ...)                                               \
+  gc_register_descriptor(sizeof(type), GC_POINTER_BITMAP(type, __VA_ARGS__))
+
+// Store a pointer into a heap object and record the slot for the next minor
+// collection. Required for stores into old objects in generational mode.
+#define GC_STORE(lvalue, value)                                                \
+  do {                                                                         \
+    (lvalue) = (value);                                                        \
+    gc_write_barrier(&(lvalue));                                               \
+  } while (0)
+
+// Result of gc_compact. Fragmentation is 1 - largest free block / total
+// free bytes: 0 when all free memory is one hole.
+struct gc_compact_stats {
+  double fragmentation_before;
+  double fragmentation_after;
+  size_t moved_blocks;
+  size_t moved_bytes;
+  size_t pinned_blocks;
+};
+
+// Cleanup registered with gc_register_finalizer
+struct finalizer {
+  struct block_meta *block;
+  void (*fn)(void *obj, void *data);
+  void *data;
+};
+
+// Weak reference (link == NULL) or disappearing link. The object is stored
+// hidden; a collection that finds it unreachable zeroes `hidden` and
+// stores NULL through `link`.
+struct gc_weak {
+  uintptr_t hidden;
+  void **link;
+};
+
+// Output state of gc_heap_snapshot and gc_profile_write: an mmap'd staging
+// buffer, so writing a dump never touches the heap it describes
+struct snapshot_writer {
+  int fd;
+  int failed;
+  unsigned char *buf;
+  size_t len;
+  size_t blocks;
+  size_t roots;
+  uintptr_t block_addr; // Block whose pointers are being written
+  uintptr_t targets[256];
+  size_t target_count;
+};
+
+// A sampled live block and where it was allocated. `weight` estimates the
+// bytes of all allocations this sample stands for.
+struct heap_sample {
+  struct block_meta *block;
+  size_t size;
+  size_t weight;
+  int depth;
+  uintptr_t pcs[PROFILE_MAX_DEPTH]; // Return addresses, innermost first
+};
+
+// Metadata at the start of a small-object page. Objects follow it at
+// SMALL_FIRST_OBJECT; free ones are chained through their first word.
+struct small_page {
+  struct small_page *next; // Next page of the same class and kind
+  void *free;              // Page-local free list, owner only
+  void *remote;            // Objects freed by other threads (lock-free)
+  uintptr_t owner;         // &small_self of the allocating thread, or 0
+  size_t obj_size;
+  uint32_t reciprocal; // 2^32 / obj_size rounded up: index by multiply
+  int count;           // Objects in the page
+  int used;
+  int atomic; // Objects hold no pointers
+  int node;   // NUMA node the page is bound to
+  uint64_t alloc[SMALL_BITMAP_WORDS];
+  uint64_t mark[SMALL_BITMAP_WORDS];
+  uint64_t old[SMALL_BITMAP_WORDS]; // Tenured: survived a collection
+};
+
+#define SMALL_FIRST_OBJECT                                                     \
+  ((sizeof(struct small_page) + SMALL_GRANULE - 1) & ~(SMALL_GRANULE - 1))
+
+// Run of equal blocks carved from the heap for one pool
+struct pool_slab {
+  struct block_meta *first;
+  size_t count;
+};
+
+// Fixed-size object cache. Free objects are chained through their first
+// payload word; objects the collector swept are picked up again when the
+// list runs dry.
+struct gc_pool {
+  size_t stride; // Header plus payload, a multiple of `align`
+  size_t align;
+  struct block_meta *free_list;
+  struct pool_slab *slabs; // mmap'd, grows with mremap
+  size_t slab_count;
+  size_t slab_capacity;
+  size_t reclaimed_at; // Collection count of the last sweep pickup
+};
+
+// Start of each chunk of a region: an atomic heap block, so only the part
+// filled so far is scanned (as a root, while the region is live)
+struct region_chunk {
+  struct region_chunk *prev;
+  char *used; // End of the objects, once a newer chunk took over
+};
+
+struct gc_region {
+  struct region_chunk *chunk; // Newest; older ones follow `prev`
+  char *next;                 // Bump pointer inside `chunk`
+  char *end;
+};
+
+// Old and new payload of a block moved by gc_compact
+struct forwarding {
+  uintptr_t from;
+  uintptr_t to;
+  size_t size;
+};
+
+// Extra root range registered by the user (scanned like the stack)
+struct root_range {
+  uintptr_t *start;
+  uintptr_t *end;
 };
 
 // Global heap tracking
 void *global_base = NULL;
 uintptr_t stack_bottom = 0;
 
+// Unused remainder of this thread's TLAB: a free block in the list that
+// other threads' find_free_block and merge_free_blocks leave alone
+static __thread struct block_meta *tlab = NULL;
+
+// No hole worth a TLAB lies before this block, or NULL to search from the
+// start. Reset whenever blocks are freed or headers go away: merging,
+// trimming, sweeping and compacting.
+static struct block_meta *refill_cursor = NULL;
+
+// A thread that takes a TLAB or a small page gets a key whose destructor
+// gives them back when it exits
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+static __thread char thread_exit_armed;
+
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+// Small-object pages: one byte per SMALL_PAGE_SIZE of heap tells free()
+// whether a pointer has no header. Each thread allocates from its own page
+// per class; the class lists hold every page.
+static int small_pages = 0;
+static unsigned char *small_map = NULL;
+static uintptr_t small_map_base = 0;
+static struct small_page *small_class_pages[MAX_NUMA_NODES][2][SMALL_CLASSES];
+static int numa_nodes = 0; // 0: NUMA placement off
+static __thread struct small_page *small_current[2][SMALL_CLASSES];
+static __thread char small_self; // Its address identifies the thread
+
+// Pools live in mmap'd memory: the data segment scan would otherwise find
+// their free-list heads, miss, and blacklist the slab pages
+static struct gc_pool *pools = NULL;
+static int pool_count = 0;
+static size_t collections = 0; // Sweeps so far, for lazy pool reclaim
+static size_t scavenge_target = DEFAULT_SCAVENGE_TARGET;
+static int huge_pages = 0;
+
+// Sizes, not addresses, past the base: the data segment scan must not
+// take the break or the commit limit for pointers into the heap
+static uintptr_t reserved_base = 0; // 0: the heap grows with sbrk
+static size_t reserved_bytes = 0;
+static size_t reserved_used = 0;      // The break, as an offset
+static size_t reserved_committed = 0; // Readable and writable up to here
+static uint32_t *granule_index = NULL; // Built with the block index
+static size_t granule_count = 0;
+
+// Payload range of the last allocation known to be zero (fresh from sbrk
+// or released by the scavenger); calloc resets it and skips clearing it
+static __thread uintptr_t zero_start = 0;
+static __thread uintptr_t zero_end = 0;
+
+// Registered roots: a fixed table so registering never calls malloc
+static struct root_range root_ranges[MAX_ROOT_RANGES];
+static int root_range_count = 0;
+
+// Writable data/BSS of the executable and every shared object, rebuilt
+// whenever the dynamic loader reports a dlopen/dlclose
+static struct root_range data_segments[MAX_DATA_SEGMENTS];
+static int data_segment_count = 0;
+static unsigned long long loaded_adds = 0;
+static unsigned long long loaded_subs = 0;
+
+// Registered type layouts, never freed so blocks can point at them
+static struct gc_descriptor descriptors[MAX_DESCRIPTORS];
+static int descriptor_count = 0;
+
+// Two generations of blacklisted pages: the ones found by the current
+// collection and the previous one. A page stays avoided for two cycles.
+static uint64_t blacklist[2][BLACKLIST_BITS / 64];
+static int blacklist_current = 0;
+static size_t false_retained_bytes = 0;
+
+// Block lookup tables, rebuilt by every gc() in mmap'd memory (not on our
+// own heap): allocated blocks in address order, the BLOCK_INTERIOR subset,
+// and an open-addressing hash of payload addresses for base-pointer hits
+static int interior_policy = GC_INTERIOR_ALL;
+static size_t interior_window = 0;
+static struct block_meta **block_index = NULL;
+static struct block_meta **interior_index = NULL;
+static struct block_meta **base_hash = NULL;
+static size_t block_index_count = 0;
+static size_t interior_index_count = 0;
+static size_t index_capacity = 0; // Entries in each of the three tables
+
+// Marked blocks whose contents still have to be scanned
+static struct block_meta **mark_stack = NULL;
+static size_t mark_stack_top = 0;
+static size_t mark_stack_capacity = 0;
+
+// Candidate pointers found by scan_heap wait in this FIFO while the
+// headers they lead to are prefetched, so the miss on each one overlaps
+// the scanning of the next. Cleared after marking, bounds included: the
+// data segment scan must not find stale heap addresses in them.
+static struct {
+  uintptr_t value;
+  int precise;
+} mark_prefetch[MARK_PREFETCH_DEPTH];
+static size_t mark_prefetch_head = 0;
+static size_t mark_prefetch_count = 0;
+static uintptr_t mark_heap_start = 0; // Words outside these bounds cannot
+static uintptr_t mark_heap_end = 0;   // point into the heap
+
+// Range filter over a run of words, picked for the CPU by gc_init
+static size_t filter_words_scalar(const uintptr_t *words, size_t count,
+                                  uintptr_t lo, uintptr_t hi, uint16_t *out);
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static size_t
+filter_words_sse42(const uintptr_t *words, size_t count, uintptr_t lo,
+                   uintptr_t hi, uint16_t *out);
+__attribute__((target("avx2"))) static size_t
+filter_words_avx2(const uintptr_t *words, size_t count, uintptr_t lo,
+                  uintptr_t hi, uint16_t *out);
+#endif
+static size_t (*filter_words)(const uintptr_t *, size_t, uintptr_t, uintptr_t,
+                              uint16_t *) = filter_words_scalar;
+
+// Generational state. The remembered set holds heap slots recorded by
+// gc_write_barrier; it lives in mmap'd memory so the data segment scan
+// does not treat its entries as roots.
+static int generational = 0;
+static int promote_age = DEFAULT_PROMOTE_AGE;
+static size_t full_growth = DEFAULT_FULL_GROWTH;
+static size_t old_bytes = 0;
+static size_t old_bytes_at_full = 0;
+static uintptr_t **remembered = NULL;
+static size_t remembered_count = 0;
+static int remembered_overflow = 0;
+
+// Handles: precise roots kept out of the conservatively scanned segments,
+// so gc_compact may move what they reference and rewrite the slot
+static void **handles = NULL;
+static int *free_handles = NULL; // Stack of released slot indices
+static size_t handle_count = 0;  // Slots ever handed out
+static size_t free_handle_count = 0;
+
+// Regions and the cache of released chunks, in one mmap'd table
+static struct gc_region *regions = NULL;
+static int *free_regions = NULL;
+static size_t region_count = 0; // Slots ever handed out
+static size_t free_region_count = 0;
+static struct region_chunk **chunk_cache = NULL;
+static size_t chunk_cache_count = 0;
+
+// Set while gc_compact marks: ambiguous references pin their target
+static int pinning = 0;
+
+// Finalizers: `finalizers` holds registrations (weak: they do not keep the
+// object alive), `finalize_queue` is a ring of unreachable objects whose
+// finalizer has not run yet (strong: marked by every collection). Both
+// live in mmap'd memory so the data segment scan cannot see them.
+static struct finalizer *finalizers = NULL;
+static struct finalizer *finalize_queue = NULL;
+static size_t finalizer_count = 0;
+static size_t finalize_head = 0; // Next entry to run
+static size_t finalize_tail = 0; // Next free ring slot
+static pthread_mutex_t finalize_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t finalize_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finalize_ready = PTHREAD_COND_INITIALIZER;
+static int finalizer_thread_started = 0;
+
+// Weak table in mmap'd memory, with a stack of released entries
+static struct gc_weak *weak_refs = NULL;
+static int *free_weak = NULL;
+static size_t weak_count = 0; // Entries ever handed out
+static size_t free_weak_count = 0;
+
+// Heap profiler: rate 0 means off. Each thread counts down the bytes left
+// until its next sample; the table of live samples is mmap'd.
+static size_t profile_rate = 0;
+static __thread intptr_t sample_countdown = 0;
+static __thread uint64_t sample_seed = 0;
+static struct heap_sample *samples = NULL;
+static size_t sample_count = 0;
+static size_t samples_dropped = 0; // Not recorded: the table was full
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // ===== ALLOCATOR FUNCTIONS =====
 struct block_meta *find_free_block(struct block_meta **last, size_t size);
 struct block_meta *request_space(struct block_meta *last, size_t size);
 void *malloc(size_t size);
 void free(void *ptr);
 void *realloc(void *ptr, size_t size);
+void *calloc(size_t nmemb, size_t size);
 void merge_free_blocks(struct block_meta *head);
+void *gc_malloc_atomic(size_t size);
+void gc_tlab_release(void);
+static void *tlab_refill(size_t size);
+static void release_on_thread_exit(void);
+const struct gc_descriptor *gc_register_descriptor(size_t type_size,
+                                                   uintptr_t bitmap);
+void *gc_malloc_typed(size_t size, const struct gc_descriptor *descr);
+void gc_allow_interior(void *ptr);
+void gc_enable_small_pages(void);
+int gc_enable_numa(void);
+static void *block_malloc(size_t size);
+static void *small_alloc(size_t size, int atomic);
+static void small_free(struct small_page *page, void *ptr);
+static struct small_page *small_page_of(const void *ptr);
+struct gc_pool *gc_pool_create(size_t obj_size, size_t align);
+void *gc_pool_alloc(struct gc_pool *pool);
+void gc_pool_free(struct gc_pool *pool, void *ptr);
+static struct block_meta *pool_refill(struct gc_pool *pool);
+struct gc_region *gc_region_begin(void);
+void *gc_region_alloc(struct gc_region *region, size_t size);
+void gc_region_release(struct gc_region *region);
+size_t gc_trim(void);
+void gc_set_trim_threshold(size_t bytes);
+static size_t trim_top(size_t threshold);
+size_t gc_scavenge(void);
+void gc_set_scavenge_target(size_t bytes);
+static size_t scavenge(size_t target, size_t budget);
+int gc_enable_huge_pages(void);
+int gc_reserve_heap(size_t bytes);
+static void *heap_sbrk(intptr_t increment);
+static uintptr_t release_granule(void);
+static size_t segment_pad(uintptr_t end);
+static void pad_segment(struct block_meta *last, uintptr_t at, size_t pad);
 
 // ===== GARBAGE COLLECTOR FUNCTIONS =====
 void gc_init(void);
 void gc(void);
+int gc_add_roots(void *start, void *end);
+int gc_remove_roots(void *start, void *end);
+int gc_add_root(void **ptr);
+int gc_remove_root(void **ptr);
+void gc_full(void);
+void gc_enable_generational(int age, size_t growth);
+void gc_write_barrier(void *slot);
+size_t gc_old_generation_bytes(void);
+static int slot_in_old(uintptr_t *slot);
+static void remember_if_young(uintptr_t *slot, int precise);
+void **gc_new_handle(void *ptr);
+void gc_free_handle(void **handle);
+void gc_compact(struct gc_compact_stats *stats);
+int gc_register_finalizer(void *ptr, void (*fn)(void *, void *), void *data);
+int gc_run_finalizers(void);
+int gc_start_finalizer_thread(void);
+static void drop_finalizer(struct block_meta *block, struct block_meta *moved);
+static void queue_finalizers(void);
+struct gc_weak *gc_weak_create(void *ptr);
+void *gc_weak_get(struct gc_weak *weak);
+void gc_weak_destroy(struct gc_weak *weak);
+int gc_register_disappearing_link(void **link, void *obj);
+int gc_unregister_disappearing_link(void **link);
+static void clear_weak_refs(void);
+static void mark_region(struct gc_region *region);
+void gc_refresh_data_segments(void);
+size_t gc_false_retained_bytes(void);
+void gc_set_interior_policy(int policy, size_t window);
+static void build_block_index(void);
+static struct block_meta *find_block(uintptr_t value);
+static void blacklist_add(uintptr_t addr);
+static uintptr_t blacklisted_page_in(uintptr_t start, uintptr_t end);
+static uintptr_t skip_blacklisted(uintptr_t payload, size_t size);
 static void scan_region(uintptr_t *start, uintptr_t *end);
+static void push_mark(struct block_meta *block);
+static int mark_small(struct block_meta *block, uintptr_t value);
+static int object_marked(struct block_meta *block, uintptr_t value);
+static void start_page_marking(struct block_meta *block, int minor);
+static size_t promote_page(struct block_meta *block, int remember);
+static void sweep_page(struct block_meta *block);
+static int mark_pointer(uintptr_t value, int precise);
+static void scan_block(struct block_meta *block,
+                       void (*visit)(uintptr_t *, int));
 static void scan_heap(void);
+static void scan_stack(void);
+static void collect(int minor);
+static void update_generations(int minor);
+
+// ===== HEAP PROFILER FUNCTIONS =====
+void gc_profile_start(size_t rate);
+void gc_profile_stop(void);
+int gc_profile_write(const char *path, int format);
+static void record_sample(struct block_meta *block);
+static void drop_sample(struct block_meta *block);
 
 // ===== UTILITY FUNCTIONS =====
 void debug_heap(void);
 void print_gc_stats(void);
 int count_allocated_blocks(void);
 int count_free_blocks(void);
+double heap_fragmentation(void);
+int gc_heap_snapshot(const char *path, int with_pointers);
 
 // ===== MAIN PROGRAM =====
 int main() {
@@ -117,6 +683,123 @@ int main() {
   free(keep);
   printf("✓ Test 3 passed\n\n");
 
+  // Test 4: Roots outside the stack and data segments
+  printf("--- Test 4: Registered Roots ---\n");
+  void **slot = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(slot != MAP_FAILED);
+  slot[0] = malloc(64); // Only referenced from the mmap region
+  gc_add_root(slot);
+
+  gc();
+  printf("After GC with root registered (block kept):\n");
+  print_gc_stats();
+
+  gc_remove_root(slot);
+  gc();
+  printf("After GC with root removed (block collected):\n");
+  print_gc_stats();
+  munmap(slot, 4096);
+  printf("✓ Test 4 passed\n\n");
+
+  // Test 5: Compaction of blocks reachable only through precise references
+  printf("--- Test 5: Compaction ---\n");
+  struct cell {
+    struct cell *next;
+    long value;
+  };
+  const struct gc_descriptor *cell_descr = GC_DESCRIPTOR(struct cell, next);
+  struct cell **list = (struct cell **)gc_new_handle(NULL);
+
+  for (int i = 0; i < 200; i++) {
+    gc_malloc_atomic(200); // Garbage between the list cells
+    struct cell *cell = gc_malloc_typed(sizeof(struct cell), cell_descr);
+    cell->next = *list;
+    cell->value = i;
+    *list = cell;
+  }
+
+  struct gc_compact_stats cstats;
+  gc_compact(&cstats);
+  printf("Moved %zu blocks, pinned %zu\n", cstats.moved_blocks,
+         cstats.pinned_blocks);
+  printf("Fragmentation: %.2f before, %.2f after\n",
+         cstats.fragmentation_before, cstats.fragmentation_after);
+  gc_free_handle((void **)list);
+  printf("✓ Test 5 passed\n\n");
+
+  // Test 6: Free space at the top of the heap goes back to the OS
+  printf("--- Test 6: Heap Trimming ---\n");
+  char *volatile peak = malloc(1 << 20); // volatile: GCC drops unused pairs
+  char *break_at_peak = heap_sbrk(0);
+  free(peak);
+  printf("Break lowered by %zu bytes after free\n",
+         (size_t)(break_at_peak - (char *)heap_sbrk(0)));
+  printf("✓ Test 6 passed\n\n");
+
+  // Test 7: Pages of a free block in the middle of the heap are released
+  printf("--- Test 7: Scavenging ---\n");
+  char *volatile hole = malloc(1 << 20);
+  char *volatile above = malloc(1 << 20); // Keeps the hole off the top
+  free(hole);
+  printf("Released %zu bytes with madvise\n", gc_scavenge());
+  hole = calloc(1, 1 << 20); // Reuses the hole without clearing it
+  printf("calloc'd block reads %d\n", hole[4096]);
+  free(hole);
+  free(above);
+  printf("✓ Test 7 passed\n\n");
+
+  // Test 8: Fixed-size pool objects are swept back into their pool
+  printf("--- Test 8: Object Pools ---\n");
+  struct gc_pool *pool = gc_pool_create(sizeof(struct cell), 0);
+  for (int i = 0; i < 1000; i++) {
+    struct cell *cell = gc_pool_alloc(pool);
+    cell->value = i;
+    if (i % 2)
+      gc_pool_free(pool, cell);
+  }
+  printf("Before GC:\n");
+  print_gc_stats();
+  gc(); // The 500 cells still allocated are unreachable
+  printf("After GC:\n");
+  print_gc_stats();
+  printf("✓ Test 8 passed\n\n");
+
+  // Test 9: A region keeps what its objects reference until it is released
+  printf("--- Test 9: Regions ---\n");
+  struct gc_region *region = gc_region_begin();
+  void **scratch = gc_region_alloc(region, 100 * sizeof(void *));
+  for (int i = 0; i < 100; i++)
+    scratch[i] = malloc(300); // Only referenced from the region
+  scratch = NULL;
+  gc();
+  printf("After GC with the region live:\n");
+  print_gc_stats();
+  gc_region_release(region);
+  gc();
+  printf("After GC with the region released:\n");
+  print_gc_stats();
+  printf("✓ Test 9 passed\n\n");
+
+  // Test 10: Small objects from size-class pages, empty pages reclaimed
+  printf("--- Test 10: Small-Object Pages ---\n");
+  gc_enable_small_pages();
+  int small_count = 0;
+  for (int i = 0; i < 20000; i++) {
+    char *small = malloc(16 + (i % 4) * 16); // Four size classes, all garbage
+    if (small) {
+      small[0] = (char)i;
+      small_count += small[0] == (char)i;
+    }
+  }
+  printf("Allocated %d small objects\n", small_count);
+  printf("Before GC:\n");
+  print_gc_stats();
+  gc();
+  printf("After GC (pages not in use by this thread are released):\n");
+  print_gc_stats();
+  printf("✓ Test 10 passed\n\n");
+
   printf("===============================================\n");
   printf("  ALL TESTS COMPLETED SUCCESSFULLY!\n");
   printf("===============================================\n");
@@ -126,23 +809,161 @@ int main() {
 
 // ========== MEMORY ALLOCATOR IMPLEMENTATION ==========
 
+// Whether a free block can serve `size` bytes; large requests also need a
+// window that avoids blacklisted pages
+static int block_fits(struct block_meta *block, size_t size) {
+  if (!block->free || block->size < size || (block->flags & BLOCK_UNSHARED))
+    return 0;
+  if (size < BLACKLIST_MIN_SIZE)
+    return 1;
+
+  uintptr_t payload = (uintptr_t)(block + 1);
+  return skip_blacklisted(payload, size) + size <= payload + block->size;
+}
+
+// Cut a free block down to `size` bytes if the rest can hold another block
+static void split_block(struct block_meta *block, size_t size) {
+  if (block->size >= size + META_SIZE + MIN_SIZE) {
+    size_t remaining = block->size - size - META_SIZE;
+    block->size = size;
+
+    struct block_meta *new_block =
+        (struct block_meta *)((char *)block + META_SIZE + size);
+
+    new_block->size = remaining;
+    new_block->free = 1;
+    new_block->marked = 0; // FIX: Initialize marked field
+    new_block->magic = 0x22222222;
+    new_block->flags = block->flags & BLOCK_RELEASED; // Its pages still are
+    new_block->descr = NULL;
+    new_block->next = block->next;
+
+    block->next = new_block;
+  }
+}
+
 struct block_meta *find_free_block(struct block_meta **last, size_t size) {
   struct block_meta *current = global_base;
-  while (current && !(current->free && current->size >= size)) {
+  while (current && !block_fits(current, size)) {
     *last = current;
     current = current->next;
   }
   return current;
 }
 
+// sbrk for the heap. After gc_reserve_heap the break moves inside the
+// reservation instead: growing commits whole chunks, shrinking returns
+// the pages and decommits the chunks left above the break.
+static void *heap_sbrk(intptr_t increment) {
+  if (!reserved_base)
+    return sbrk(increment);
+
+  size_t old = reserved_used;
+  if (increment > 0 ? (size_t)increment > reserved_bytes - old
+                    : (size_t)-increment > old)
+    return (void *)-1;
+  size_t top = old + (size_t)increment;
+
+  if (top > reserved_committed) {
+    size_t end = (top + COMMIT_CHUNK - 1) & ~(COMMIT_CHUNK - 1);
+    if (end > reserved_bytes)
+      end = reserved_bytes;
+    if (mprotect((void *)(reserved_base + reserved_committed),
+                 end - reserved_committed, PROT_READ | PROT_WRITE) != 0)
+      return (void *)-1;
+    reserved_committed = end;
+  } else if (increment < 0) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = (top + COMMIT_CHUNK - 1) & ~(COMMIT_CHUNK - 1);
+    if (keep < reserved_committed) {
+      mmap((void *)(reserved_base + keep), reserved_committed - keep,
+           PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+           -1, 0);
+      reserved_committed = keep;
+    }
+    // New break space must read as zeros again (request_space)
+    size_t first = (top + page - 1) & ~(page - 1);
+    if (first < reserved_committed)
+      madvise((void *)(reserved_base + first), reserved_committed - first,
+              MADV_DONTNEED);
+  }
+
+  reserved_used = top;
+  return (void *)(reserved_base + old);
+}
+
+// Reserve `bytes` of address space for the heap before the first
+// allocation. The heap can then never run into other mappings, and
+// interior pointers are resolved through a granule index instead of a
+// binary search. Returns 0, or -1 if the heap already exists.
+int gc_reserve_heap(size_t bytes) {
+  if (reserved_base || global_base || small_pages)
+    return -1;
+
+  bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  void *range = mmap(NULL, bytes + HUGE_PAGE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (range == MAP_FAILED)
+    return -1;
+
+  // Aligned for huge pages and small-object pages alike
+  uintptr_t base =
+      ((uintptr_t)range + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  if (base > (uintptr_t)range)
+    munmap(range, base - (uintptr_t)range);
+  if ((uintptr_t)range + HUGE_PAGE_SIZE > base)
+    munmap((void *)(base + bytes), (uintptr_t)range + HUGE_PAGE_SIZE - base);
+
+  granule_index = mmap(NULL, (bytes >> GRANULE_SHIFT) * sizeof(uint32_t),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (granule_index == MAP_FAILED) {
+    munmap((void *)base, bytes);
+    granule_index = NULL;
+    return -1;
+  }
+
+  reserved_base = base;
+  reserved_bytes = bytes;
+  return 0;
+}
+
 struct block_meta *request_space(struct block_meta *last, size_t size) {
-  struct block_meta *block = sbrk(0);
-  void *request = sbrk(size + META_SIZE);
+  struct block_meta *block = heap_sbrk(0);
+  size_t gap = 0;
+
+  // Large block: grow past blacklisted pages and keep the skipped space
+  // as a free block for small allocations
+  if (last && size >= BLACKLIST_MIN_SIZE) {
+    uintptr_t payload = (uintptr_t)(block + 1);
+    gap = skip_blacklisted(payload, size) - payload;
+  }
+
+  uintptr_t end = (uintptr_t)(block + 1) + gap + size;
+  size_t pad = segment_pad(end);
+  void *request = heap_sbrk(gap + size + META_SIZE + pad);
 
   assert((void *)block == request);
   if (request == (void *)-1) {
     return NULL;
   }
+  if (huge_pages)
+    madvise(block, gap + size + META_SIZE + pad, MADV_HUGEPAGE);
+
+  if (gap) {
+    struct block_meta *skipped = block;
+    skipped->size = gap - META_SIZE;
+    skipped->next = NULL;
+    skipped->free = 1;
+    skipped->marked = 0;
+    skipped->magic = 0x55555555;
+    skipped->flags = 0;
+    skipped->descr = NULL;
+
+    last->next = skipped;
+    last = skipped;
+    block = (struct block_meta *)((char *)block + gap);
+  }
 
   if (last) {
     last->next = block;
@@ -153,11 +974,37 @@ struct block_meta *request_space(struct block_meta *last, size_t size) {
   block->free = 0;
   block->marked = 1;
   block->magic = 0x12345678;
+  block->flags = 0;
+  block->descr = NULL;
+  if (pad)
+    pad_segment(block, end, pad);
+
+  // The kernel hands out new break space zero-filled
+  zero_start = (uintptr_t)(block + 1);
+  zero_end = zero_start + size;
 
   return block;
 }
 
+// Count the block against this thread's sampling interval. Kept inline:
+// with the profiler off this is one load and a branch.
+static inline void *sampled(struct block_meta *block) {
+  if (profile_rate && (sample_countdown -= (intptr_t)block->size) < 0)
+    record_sample(block);
+  return (block + 1);
+}
+
 void *malloc(size_t size) {
+  if (small_pages && size && size <= SMALL_MAX) {
+    void *ptr = small_alloc(size, 0);
+    if (ptr)
+      return ptr;
+  }
+  return block_malloc(size);
+}
+
+// Allocation with a block header: everything but small-page objects
+static void *block_malloc(size_t size) {
   if (size <= 0) {
     return NULL;
   }
@@ -167,6 +1014,32 @@ void *malloc(size_t size) {
 
   struct block_meta *block;
 
+  // Fast path: carve the object off the front of this thread's TLAB
+  if (size <= TLAB_MAX_OBJECT) {
+    block = tlab;
+    if (!block || block->size < size + META_SIZE + MIN_SIZE)
+      return tlab_refill(size);
+
+    struct block_meta *rest =
+        (struct block_meta *)((char *)block + META_SIZE + size);
+    rest->size = block->size - size - META_SIZE;
+    rest->next = block->next;
+    rest->free = 1;
+    rest->marked = 0;
+    rest->magic = 0x22222222;
+    rest->flags = BLOCK_TLAB;
+    tlab = rest;
+
+    block->size = size;
+    block->next = rest;
+    block->free = 0;
+    block->marked = 1;
+    block->magic = 0x77777777;
+    block->flags = 0;
+    block->descr = NULL;
+    return sampled(block);
+  }
+
   if (!global_base) {
     block = request_space(NULL, size);
     if (!block)
@@ -181,44 +1054,203 @@ void *malloc(size_t size) {
       if (!block)
         return NULL;
     } else {
-      // Reuse free block - split if large enough
-      if (block->size >= size + META_SIZE + MIN_SIZE) {
-        size_t remaining = block->size - size - META_SIZE;
-        block->size = size;
-
-        struct block_meta *new_block =
-            (struct block_meta *)((char *)block + META_SIZE + size);
+      if (block->flags & BLOCK_RELEASED) {
+        uintptr_t page = release_granule();
+        zero_start = ((uintptr_t)(block + 1) + page - 1) & ~(page - 1);
+        zero_end = ((uintptr_t)(block + 1) + block->size) & ~(page - 1);
+      }
 
-        new_block->size = remaining;
-        new_block->free = 1;
-        new_block->marked = 0; // FIX: Initialize marked field
-        new_block->magic = 0x22222222;
-        new_block->next = block->next;
+      // Large block: leave blacklisted pages at the front as a free block
+      if (size >= BLACKLIST_MIN_SIZE) {
+        uintptr_t payload = (uintptr_t)(block + 1);
+        size_t skip = skip_blacklisted(payload, size) - payload;
 
-        block->next = new_block;
+        if (skip) {
+          struct block_meta *front = block;
+          block = (struct block_meta *)((char *)front + skip);
+          block->size = front->size - skip;
+          block->next = front->next;
+          block->flags = front->flags & BLOCK_RELEASED; // Not payload bytes
+          block->descr = NULL;
+          front->size = skip - META_SIZE;
+          front->next = block;
+        }
       }
 
+      // Reuse free block - split if large enough
+      split_block(block, size);
+
       block->free = 0;
       block->marked = 1;
       block->magic = 0x77777777;
+      block->flags = 0;
+      block->descr = NULL;
     }
   }
 
-  return (block + 1);
+  return sampled(block);
+}
+
+// Retire the current TLAB and take a new one: a large enough free hole if
+// there is one, otherwise fresh space at the top of the heap. The search
+// resumes at refill_cursor instead of walking the whole list.
+//
+// A TLAB is never the last block: request_space links new blocks after
+// the last one from other threads, and the owner's fast path reads and
+// rewrites its TLAB's `next` without a lock. A free block of its own is
+// left behind it instead.
+static __attribute__((noinline)) void *tlab_refill(size_t size) {
+  gc_tlab_release();
+  release_on_thread_exit();
+
+  struct block_meta *last = NULL;
+  struct block_meta *chunk = refill_cursor ? refill_cursor : global_base;
+  while (chunk && !(block_fits(chunk, TLAB_MIN_REFILL) &&
+                    (chunk->next || chunk->size >= TLAB_MIN_REFILL +
+                                                       META_SIZE + MIN_SIZE))) {
+    last = chunk;
+    chunk = chunk->next;
+  }
+
+  if (!chunk) {
+    chunk = request_space(last, TLAB_SIZE + META_SIZE + MIN_SIZE);
+    if (!chunk)
+      return NULL;
+    if (!global_base)
+      global_base = chunk;
+  }
+
+  // Don't let one thread hoard a huge hole
+  size_t keep = chunk->size;
+  if (keep >= TLAB_SIZE + META_SIZE + MIN_SIZE)
+    keep = TLAB_SIZE;
+  else if (!chunk->next)
+    keep -= META_SIZE + MIN_SIZE;
+  if (keep < chunk->size) {
+    struct block_meta *rest =
+        (struct block_meta *)((char *)chunk + META_SIZE + keep);
+    rest->size = chunk->size - keep - META_SIZE;
+    rest->next = chunk->next;
+    rest->free = 1;
+    rest->marked = 0;
+    rest->magic = 0x22222222;
+    rest->flags = 0;
+    rest->descr = NULL;
+    chunk->size = keep;
+    chunk->next = rest;
+  }
+
+  chunk->free = 1;
+  chunk->marked = 0;
+  chunk->magic = 0x22222222;
+  chunk->flags = BLOCK_TLAB;
+  chunk->descr = NULL;
+  tlab = chunk;
+  refill_cursor = chunk;
+
+  return block_malloc(size);
+}
+
+static void thread_exit_release(void *arg) {
+  (void)arg;
+  gc_tlab_release();
+}
+
+static void create_thread_exit_key(void) {
+  pthread_key_create(&thread_exit_key, thread_exit_release);
+}
+
+// Arm the exit destructor once per thread. The flag is set first: should
+// pthread_setspecific allocate, the nested refill returns right here.
+static void release_on_thread_exit(void) {
+  if (thread_exit_armed)
+    return;
+  thread_exit_armed = 1;
+  pthread_once(&thread_exit_once, create_thread_exit_key);
+  pthread_setspecific(thread_exit_key, &thread_exit_armed);
+}
+
+// Give this thread's TLAB remainder and small pages back to the shared
+// heap. Threads do this when they exit; calling it releases them earlier.
+void gc_tlab_release(void) {
+  if (tlab) {
+    tlab->flags &= ~BLOCK_TLAB;
+    tlab = NULL;
+  }
+
+  // Small pages likewise: an owned page is never handed to another thread
+  for (int kind = 0; kind < 2; kind++) {
+    for (int c = 0; c < SMALL_CLASSES; c++) {
+      if (small_current[kind][c])
+        __atomic_store_n(&small_current[kind][c]->owner, 0, __ATOMIC_RELEASE);
+      small_current[kind][c] = NULL;
+    }
+  }
+}
+
+void *gc_malloc_atomic(size_t size) {
+  if (small_pages && size && size <= SMALL_MAX) {
+    void *ptr = small_alloc(size, 1);
+    if (ptr)
+      return ptr;
+  }
+
+  void *ptr = block_malloc(size);
+  if (ptr)
+    ((struct block_meta *)ptr - 1)->flags |= BLOCK_ATOMIC;
+  return ptr;
+}
+
+const struct gc_descriptor *gc_register_descriptor(size_t type_size,
+                                                   uintptr_t bitmap) {
+  size_t words = (type_size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+
+  // One bitmap word describes at most 64 pointer slots
+  if (words == 0 || words > sizeof(uintptr_t) * 8)
+    return NULL;
+
+  for (int i = 0; i < descriptor_count; i++) {
+    if (descriptors[i].words == words && descriptors[i].bitmap == bitmap)
+      return &descriptors[i];
+  }
+
+  if (descriptor_count == MAX_DESCRIPTORS)
+    return NULL;
+
+  descriptors[descriptor_count].words = words;
+  descriptors[descriptor_count].bitmap = bitmap;
+  return &descriptors[descriptor_count++];
+}
+
+void *gc_malloc_typed(size_t size, const struct gc_descriptor *descr) {
+  void *ptr = block_malloc(size);
+  if (ptr)
+    ((struct block_meta *)ptr - 1)->descr = descr;
+  return ptr;
+}
+
+// Small-page objects follow the interior policy; they have no flags
+void gc_allow_interior(void *ptr) {
+  if (ptr && !small_page_of(ptr))
+    ((struct block_meta *)ptr - 1)->flags |= BLOCK_INTERIOR;
 }
 
 void merge_free_blocks(struct block_meta *head) {
   struct block_meta *current = head;
+  refill_cursor = NULL;
 
   while (current && current->next) {
     struct block_meta *next = current->next;
 
-    // Check if both blocks are free and adjacent
+    // Check if both blocks are free and adjacent (a TLAB remainder or pool
+    // object must keep its header where its owner expects it)
     if (current->free && next->free &&
+        !((current->flags | next->flags) & BLOCK_UNSHARED) &&
         ((char *)current + META_SIZE + current->size == (char *)next)) {
 
       current->size += META_SIZE + next->size;
       current->next = next->next;
+      current->flags &= ~BLOCK_RELEASED; // next's header is now payload
       // Don't advance - might merge again
     } else {
       current = current->next;
@@ -230,16 +1262,30 @@ void free(void *ptr) {
   if (!ptr)
     return;
 
+  struct small_page *page = small_page_of(ptr);
+  if (page) {
+    small_free(page, ptr);
+    return;
+  }
+
   struct block_meta *block = (struct block_meta *)ptr - 1;
 
   assert(block->free == 0);
   assert(block->magic == 0x77777777 || block->magic == 0x12345678);
 
+  if (block->flags & BLOCK_OLD)
+    old_bytes -= block->size;
+  if (block->flags & BLOCK_FINALIZABLE)
+    drop_finalizer(block, NULL); // Freed by hand: nothing left to clean up
+  if (block->flags & BLOCK_SAMPLED)
+    drop_sample(block);
+
   block->free = 1;
   block->marked = 0;
   block->magic = 0x55555555;
 
   merge_free_blocks(global_base);
+  trim_top(trim_threshold);
 }
 
 void *realloc(void *ptr, size_t size) {
@@ -252,160 +1298,2446 @@ void *realloc(void *ptr, size_t size) {
     return NULL;
   }
 
+  struct small_page *page = small_page_of(ptr);
+  if (page) {
+    if (size <= page->obj_size)
+      return ptr;
+    void *new_ptr = malloc(size);
+    if (new_ptr) {
+      memcpy(new_ptr, ptr, page->obj_size);
+      small_free(page, ptr);
+    }
+    return new_ptr;
+  }
+
   struct block_meta *block = (struct block_meta *)ptr - 1;
 
   if (size <= block->size) {
     return ptr; // Current block is big enough
   }
 
-  // Need larger block - allocate new and copy
-  void *new_ptr = malloc(size);
+  // Need larger block - allocate new and copy (keeping the header, which
+  // carries the block's type)
+  void *new_ptr = block_malloc(size);
   if (new_ptr) {
+    struct block_meta *new_block = (struct block_meta *)new_ptr - 1;
+    new_block->flags = (new_block->flags & BLOCK_SAMPLE_BITS) |
+                       (block->flags & BLOCK_TYPE_FLAGS);
+    new_block->descr = block->descr;
     memcpy(new_ptr, ptr, block->size);
+    if (block->flags & BLOCK_FINALIZABLE)
+      drop_finalizer(block, new_block);
     free(ptr);
   }
 
   return new_ptr;
 }
 
-// ========== GARBAGE COLLECTOR IMPLEMENTATION ==========
+// Lower the break over the free blocks at the top of the heap if together
+// they exceed `threshold`. The first of them keeps its header and the rest
+// of its page; returns the bytes given back to the OS.
+static size_t trim_top(size_t threshold) {
+  struct block_meta *run = NULL; // First block of the free run at the top
+  struct block_meta *last = NULL;
 
-void gc_init(void) {
-  static int initialized = 0;
+  for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+    if (!b->free || (b->flags & BLOCK_UNSHARED))
+      run = NULL;
+    else if (!run || (char *)last + META_SIZE + last->size != (char *)b)
+      run = b;
+    last = b;
+  }
+  if (!run)
+    return 0;
 
-  if (initialized)
-    return;
-  initialized = 1;
+  // Someone else moved the break: the space above us is not ours
+  char *top = (char *)last + META_SIZE + last->size;
+  if (top != heap_sbrk(0))
+    return 0;
 
-  FILE *statfp = fopen("/proc/self/stat", "r");
-  assert(statfp != NULL);
+  // The sweep leaves neighbours unmerged: fold the run into one block
+  refill_cursor = NULL;
+  if (run != last)
+    run->flags &= ~BLOCK_RELEASED;
+  run->size = (size_t)(top - (char *)(run + 1));
+  run->next = NULL;
+  if (run->size < threshold)
+    return 0;
 
-  fscanf(statfp,
-         "%*d %*s %*c %*d %*d %*d %*d %*d %*u "
-         "%*lu %*lu %*lu %*lu %*lu %*lu %*ld %*ld "
-         "%*ld %*ld %*ld %*ld %*llu %*lu %*ld "
-         "%*lu %*lu %*lu %lu",
-         &stack_bottom);
+  uintptr_t page = release_granule();
+  uintptr_t keep = ((uintptr_t)(run + 1) + MIN_SIZE + page - 1) & ~(page - 1);
+  if (keep >= (uintptr_t)top)
+    return 0;
 
-  fclose(statfp);
+  size_t release = (size_t)((uintptr_t)top - keep);
+  if (heap_sbrk(-(intptr_t)release) == (void *)-1)
+    return 0;
+  run->size -= release;
+
+  // Slots recorded by the write barrier may lie in the released pages
+  size_t kept = 0;
+  for (size_t i = 0; i < remembered_count; i++) {
+    if ((uintptr_t)remembered[i] < keep)
+      remembered[kept++] = remembered[i];
+  }
+  remembered_count = kept;
+
+  return release;
 }
 
-static void scan_region(uintptr_t *start, uintptr_t *end) {
-  if (!global_base)
-    return;
+// Give all free space at the top of the heap back to the OS now
+size_t gc_trim(void) { return trim_top(0); }
 
-  uintptr_t heap_start = (uintptr_t)(global_base) + META_SIZE;
-  uintptr_t heap_end = (uintptr_t)sbrk(0);
+// Automatic trimming threshold; SIZE_MAX turns it off
+void gc_set_trim_threshold(size_t bytes) { trim_threshold = bytes; }
 
-  // Scan each word in the region
-  for (uintptr_t *p = start; p < end; p++) {
-    uintptr_t value = *p;
+// madvise(MADV_DONTNEED) the whole pages inside large free blocks, in
+// address order, until at most `target` of those bytes stay resident or
+// about `budget` bytes were released. Released blocks get BLOCK_RELEASED:
+// their pages read back as zeros, which MADV_FREE would not guarantee.
+static size_t scavenge(size_t target, size_t budget) {
+  uintptr_t page = release_granule();
+  size_t resident = 0;
 
-    // Check if value looks like a heap pointer
-    if (value >= heap_start && value < heap_end) {
+  for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+    if (b->free && b->size >= SCAVENGE_MIN_SIZE &&
+        !(b->flags & (BLOCK_UNSHARED | BLOCK_RELEASED)))
+      resident += b->size;
+  }
+  if (resident <= target)
+    return 0;
 
-      // Find which block it points into
-      struct block_meta *block = global_base;
-      while (block) {
-        uintptr_t block_start = (uintptr_t)(block + 1);
-        uintptr_t block_end = block_start + block->size;
-
-        if (value >= block_start && value < block_end) {
-          block->marked = 1; // Mark as reachable
-          break;
-        }
+  size_t released = 0;
+  for (struct block_meta *b = global_base;
+       b != NULL && resident > target && released < budget; b = b->next) {
+    if (!b->free || b->size < SCAVENGE_MIN_SIZE ||
+        (b->flags & (BLOCK_UNSHARED | BLOCK_RELEASED)))
+      continue;
 
-        block = block->next;
-      }
-    }
+    uintptr_t start = ((uintptr_t)(b + 1) + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)(b + 1) + b->size) & ~(page - 1);
+    resident -= b->size;
+    if (end <= start ||
+        madvise((void *)start, end - start, MADV_DONTNEED) != 0)
+      continue;
+
+    b->flags |= BLOCK_RELEASED;
+    released += end - start;
   }
+  return released;
 }
 
-static void scan_heap(void) {
-  if (!global_base)
-    return;
+// Release the pages of every large free block now
+size_t gc_scavenge(void) { return scavenge(0, SIZE_MAX); }
 
-  int new_marks;
+// Free bytes the automatic scavenger leaves resident; SIZE_MAX turns it off
+void gc_set_scavenge_target(size_t bytes) { scavenge_target = bytes; }
 
-  // Compute transitive closure
-  do {
-    new_marks = 0;
+// Smallest unit the heap gives pages back in
+static uintptr_t release_granule(void) {
+  return huge_pages ? HUGE_PAGE_SIZE : (uintptr_t)sysconf(_SC_PAGESIZE);
+}
 
-    // FIX: Reset to beginning each iteration
-    struct block_meta *block = global_base;
+// Bytes to grow past `end` so the break lands on a huge page boundary,
+// leaving room for the free block that covers them; 0 outside huge mode
+static size_t segment_pad(uintptr_t end) {
+  if (!huge_pages)
+    return 0;
+  size_t pad = ((end + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1)) - end;
+  if (pad && pad < META_SIZE + MIN_SIZE)
+    pad += HUGE_PAGE_SIZE;
+  return pad;
+}
 
-    for (; block != NULL; block = block->next) {
-      if (!block->marked)
-        continue;
+// Make the `pad` bytes at `at`, the new top of the heap, a free block
+// after `last`
+static void pad_segment(struct block_meta *last, uintptr_t at, size_t pad) {
+  struct block_meta *rest = (struct block_meta *)at;
+  rest->size = pad - META_SIZE;
+  rest->next = NULL;
+  rest->free = 1;
+  rest->marked = 0;
+  rest->magic = 0x55555555;
+  rest->flags = 0;
+  rest->descr = NULL;
+  if (last)
+    last->next = rest;
+  else
+    global_base = rest;
+}
 
-      // Scan this block's data for pointers
-      uintptr_t *data = (uintptr_t *)(block + 1);
-
-      // FIX: Divide by sizeof(uintptr_t) to get count
-      size_t word_count = block->size / sizeof(uintptr_t);
-
-      for (size_t i = 0; i < word_count; i++) {
-        uintptr_t value = data[i];
-
-        // Check if it points to another block
-        // FIX: Initialize other_block to global_base
-        for (struct block_meta *other = global_base; other != NULL;
-             other = other->next) {
-          if (!other->marked) {
-            uintptr_t other_start = (uintptr_t)(other + 1);
-            // FIX: Cast to char* for byte arithmetic
-            uintptr_t other_end =
-                (uintptr_t)((char *)(other + 1) + other->size);
-
-            if (value >= other_start && value < other_end) {
-              other->marked = 1;
-              new_marks = 1;
-            }
-          }
-        }
-      }
+// Grow the heap in 2 MiB segments backed by transparent huge pages, which
+// cuts the TLB misses of a mark phase that walks the whole heap. Returns 0
+// if the kernel has THP disabled, else aligns the break and returns 1.
+int gc_enable_huge_pages(void) {
+  if (huge_pages)
+    return 1;
+
+  char buf[64];
+  int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  if (strstr(buf, "[never]"))
+    return 0;
+
+  struct block_meta *last = global_base;
+  while (last && last->next)
+    last = last->next;
+
+  huge_pages = 1;
+  uintptr_t top = (uintptr_t)heap_sbrk(0);
+  size_t pad = segment_pad(top);
+  if (pad) {
+    if (heap_sbrk(pad) != (void *)top) {
+      huge_pages = 0;
+      return 0;
     }
-  } while (new_marks);
+    pad_segment(last, top, pad);
+    madvise((void *)(top + pad - HUGE_PAGE_SIZE), HUGE_PAGE_SIZE,
+            MADV_HUGEPAGE);
+  }
+  return 1;
 }
 
-void gc(void) {
-  if (!global_base)
-    return;
+// Also replaces libc's calloc, whose blocks our free() could not release
+// (glibc uses it for thread-local storage in pthread_create)
+void *calloc(size_t nmemb, size_t size) {
+  if (size && nmemb > (size_t)-1 / size)
+    return NULL;
 
-  extern char etext, end; // Linker-provided symbols
-  struct block_meta *block = global_base;
-  for (; block != NULL; block = block->next) {
-    block->marked = 0;
+  // Clear the whole block by its header size; a plain memset of the
+  // request size is turned back into a calloc() call by GCC at -O2
+  zero_start = zero_end = 0;
+  void *ptr = malloc(nmemb * size);
+  if (!ptr)
+    return NULL;
+
+  struct small_page *page = small_page_of(ptr);
+  if (page) {
+    memset(ptr, 0, page->obj_size);
+    return ptr;
   }
 
-  // Mark phase: Scan roots
-  scan_region((uintptr_t *)&etext, (uintptr_t *)&end);
+  // Pages known to be zero (fresh or scavenged) are not touched, so they
+  // stay unbacked until the caller writes them
+  uintptr_t start = (uintptr_t)ptr;
+  uintptr_t end = start + ((struct block_meta *)ptr - 1)->size;
+  uintptr_t lo = zero_start > start ? zero_start : start;
+  uintptr_t hi = zero_end < end ? zero_end : end;
+  if (lo < hi) {
+    memset(ptr, 0, lo - start);
+    memset((void *)hi, 0, end - hi);
+  } else {
+    memset(ptr, 0, end - start);
+  }
+  return ptr;
+}
 
-  // Scan stack
-  uintptr_t stack_top;
-#ifdef __x86_64__
-  asm volatile("movq %%rbp, %0" : "=r"(stack_top));
-#else
-  asm volatile("movl %%ebp, %0" : "=r"(stack_top));
-#endif
-  scan_region((uintptr_t *)stack_top, (uintptr_t *)stack_bottom);
+// ========== SMALL-OBJECT PAGE IMPLEMENTATION ==========
 
-  // Scan heap for pointer chains
+// Serve malloc/gc_malloc_atomic requests up to SMALL_MAX bytes from
+// size-class pages from now on. Finalizers and typed descriptors need a
+// block header, so those objects stay in blocks, as does each allocation
+// the heap profiler samples (small allocations still count toward it).
+void gc_enable_small_pages(void) {
+  if (small_pages)
+    return;
+
+  small_map = mmap(NULL, SMALL_MAP_SPAN >> SMALL_PAGE_SHIFT,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(small_map != MAP_FAILED);
+  small_map_base = (global_base ? (uintptr_t)global_base : (uintptr_t)heap_sbrk(0)) &
+                   ~(SMALL_PAGE_SIZE - 1);
+  small_pages = 1;
+}
+
+// Page holding `ptr`, or NULL if `ptr` is an ordinary block's payload
+static struct small_page *small_page_of(const void *ptr) {
+  uintptr_t offset = (uintptr_t)ptr - small_map_base;
+  if (!small_map || offset >= SMALL_MAP_SPAN ||
+      !small_map[offset >> SMALL_PAGE_SHIFT])
+    return NULL;
+  return (struct small_page *)((uintptr_t)ptr & ~(SMALL_PAGE_SIZE - 1));
+}
+
+// Object number of the address `value` in `page`, or -1
+static long small_index(struct small_page *page, uintptr_t value) {
+  uintptr_t first = (uintptr_t)page + SMALL_FIRST_OBJECT;
+  if (value < first)
+    return -1;
+  uint64_t i = ((uint64_t)(value - first) * page->reciprocal) >> 32;
+  return i < (uint64_t)page->count ? (long)i : -1;
+}
+
+// Nodes listed in /sys/devices/system/node/online ("0-1", "0,2-3"):
+// the highest plus one, or 0 if the file is missing
+static int read_online_nodes(void) {
+  char buf[256];
+  int fd = open("/sys/devices/system/node/online", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+
+  int highest = 0, value = 0;
+  for (char *p = buf; *p; p++) {
+    if (*p >= '0' && *p <= '9') {
+      value = value * 10 + (*p - '0');
+    } else {
+      if (value > highest)
+        highest = value;
+      value = 0;
+    }
+  }
+  return (value > highest ? value : highest) + 1;
+}
+
+// Place small pages on the NUMA node of the thread that first allocates
+// from them: each node keeps its own page lists, new pages are bound there
+// with mbind, and threads only adopt pages of their current node. Turns on
+// small pages; returns the number of nodes used.
+int gc_enable_numa(void) {
+  gc_enable_small_pages();
+  if (!numa_nodes) {
+    numa_nodes = read_online_nodes();
+    if (numa_nodes < 1)
+      numa_nodes = 1;
+    if (numa_nodes > MAX_NUMA_NODES)
+      numa_nodes = MAX_NUMA_NODES;
+  }
+  return numa_nodes;
+}
+
+// Node of the CPU this thread runs on right now
+static int current_node(void) {
+  unsigned cpu, node;
+  if (numa_nodes < 2 || syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    return 0;
+  return node < (unsigned)numa_nodes ? (int)node : 0;
+}
+
+// Map a new page at the top of the heap, bound to `node` before anything
+// touches its objects. Any space skipped to align it becomes a free block.
+static struct small_page *small_page_new(int cls, int atomic, int node) {
+  struct block_meta *prev = NULL, *last = global_base;
+  while (last && last->next) {
+    prev = last;
+    last = last->next;
+  }
+
+  // In huge-page mode the top of the heap is usually the free rest of a
+  // segment: build the page there instead of starting another segment
+  uintptr_t brk = (uintptr_t)heap_sbrk(0);
+  uintptr_t top = brk;
+  if (huge_pages && last && last->free && !(last->flags & BLOCK_UNSHARED) &&
+      (uintptr_t)(last + 1) + last->size == brk) {
+    top = (uintptr_t)last;
+    last = prev;
+    refill_cursor = NULL;
+  }
+
+  uintptr_t payload =
+      (top + META_SIZE + SMALL_PAGE_SIZE - 1) & ~(SMALL_PAGE_SIZE - 1);
+  size_t gap = payload - META_SIZE - top;
+  if (gap && gap < META_SIZE + MIN_SIZE) {
+    payload += SMALL_PAGE_SIZE;
+    gap += SMALL_PAGE_SIZE;
+  }
+
+  if (payload - small_map_base + SMALL_PAGE_SIZE > SMALL_MAP_SPAN)
+    return NULL;
+  uintptr_t end = payload + SMALL_PAGE_SIZE;
+  size_t pad;
+  if (end + META_SIZE + MIN_SIZE <= brk || end == brk) {
+    pad = brk - end;
+  } else {
+    pad = segment_pad(end);
+    if (heap_sbrk(end + pad - brk) != (void *)brk)
+      return NULL;
+    if (huge_pages)
+      madvise((void *)brk, end + pad - brk, MADV_HUGEPAGE);
+  }
+
+  // Preferred rather than strict: a full node must not fail malloc
+  if (numa_nodes > 1) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, payload, SMALL_PAGE_SIZE, MPOL_PREFERRED, &mask,
+            sizeof(mask) * 8, 0);
+  }
+
+  if (gap) {
+    struct block_meta *skipped = (struct block_meta *)top;
+    skipped->size = gap - META_SIZE;
+    skipped->next = NULL;
+    skipped->free = 1;
+    skipped->marked = 0;
+    skipped->magic = 0x55555555;
+    skipped->flags = 0;
+    skipped->descr = NULL;
+    if (last)
+      last->next = skipped;
+    else
+      global_base = skipped;
+    last = skipped;
+  }
+
+  // Every address in the page leads the collector to it, whatever the
+  // interior policy; mark_small then applies the policy per object
+  struct block_meta *block = (struct block_meta *)(payload - META_SIZE);
+  block->size = SMALL_PAGE_SIZE;
+  block->next = NULL;
+  block->free = 0;
+  block->marked = 1;
+  block->magic = SMALL_PAGE_MAGIC;
+  block->flags = BLOCK_INTERIOR;
+  block->descr = NULL;
+  if (last)
+    last->next = block;
+  else
+    global_base = block;
+  if (pad)
+    pad_segment(block, end, pad);
+
+  struct small_page *page = (struct small_page *)payload;
+  memset(page, 0, sizeof(*page));
+  page->obj_size = (size_t)(cls + 1) * SMALL_GRANULE;
+  page->reciprocal = (uint32_t)((((uint64_t)1 << 32) + page->obj_size - 1) /
+                                page->obj_size);
+  page->count = (int)((SMALL_PAGE_SIZE - SMALL_FIRST_OBJECT) / page->obj_size);
+  page->atomic = atomic;
+  page->node = node;
+
+  for (int i = page->count; i-- > 0;) {
+    void **obj = (void **)(payload + SMALL_FIRST_OBJECT + i * page->obj_size);
+    *obj = page->free;
+    page->free = obj;
+  }
+
+  page->next = small_class_pages[node][atomic][cls];
+  small_class_pages[node][atomic][cls] = page;
+  small_map[(payload - small_map_base) >> SMALL_PAGE_SHIFT] = 1;
+  return page;
+}
+
+// Take the objects other threads freed into the page's local free list.
+// Called by the owner, or by gc() while the world is stopped.
+static int small_drain(struct small_page *page) {
+  void *list = __atomic_exchange_n(&page->remote, NULL, __ATOMIC_ACQUIRE);
+  int drained = 0;
+
+  while (list) {
+    void *next = *(void **)list;
+    long i = small_index(page, (uintptr_t)list);
+    page->alloc[i / 64] &= ~((uint64_t)1 << (i % 64));
+    page->old[i / 64] &= ~((uint64_t)1 << (i % 64));
+    page->used--;
+    *(void **)list = page->free;
+    page->free = list;
+    list = next;
+    drained++;
+  }
+  return drained;
+}
+
+// Refill from the current page's remote frees, else switch this thread to
+// an unowned page of the class on its node with free objects, mapping a
+// new one only if none has any
+static __attribute__((noinline)) struct small_page *small_refill(int cls,
+                                                                 int atomic) {
+  uintptr_t self = (uintptr_t)&small_self;
+  int node = current_node();
+  struct small_page *page = small_current[atomic][cls];
+  if (page) {
+    if (page->node == node && small_drain(page))
+      return page;
+    __atomic_store_n(&page->owner, 0, __ATOMIC_RELEASE);
+  }
+
+  for (page = small_class_pages[node][atomic][cls]; page; page = page->next) {
+    uintptr_t none = 0;
+    if ((page->free || __atomic_load_n(&page->remote, __ATOMIC_RELAXED)) &&
+        __atomic_compare_exchange_n(&page->owner, &none, self, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      small_drain(page);
+      if (page->free)
+        break;
+      __atomic_store_n(&page->owner, 0, __ATOMIC_RELEASE);
+    }
+  }
+  if (!page) {
+    if (!(page = small_page_new(cls, atomic, node)))
+      return NULL;
+    page->owner = self;
+  }
+
+  release_on_thread_exit();
+  small_current[atomic][cls] = page;
+  return page;
+}
+
+// Returns NULL for the request the heap profiler samples next: samples
+// live in block headers, so the caller's block_malloc takes that one
+static void *small_alloc(size_t size, int atomic) {
+  if (profile_rate && sample_countdown < (intptr_t)size)
+    return NULL;
+  if (profile_rate)
+    sample_countdown -= (intptr_t)size;
+
+  int cls = (int)((size - 1) / SMALL_GRANULE);
+  struct small_page *page = small_current[atomic][cls];
+  if ((!page || !page->free) && !(page = small_refill(cls, atomic)))
+    return NULL;
+
+  void **obj = page->free;
+  page->free = *obj;
+  *obj = NULL; // The link would read as a pointer into the page
+
+  long i = small_index(page, (uintptr_t)obj);
+  page->alloc[i / 64] |= (uint64_t)1 << (i % 64);
+  page->used++;
+  return obj;
+}
+
+// Push the object on its page's free list: no headers, no coalescing. A
+// thread that does not own the page pushes onto the remote list with one
+// CAS instead; the owner drains it in a batch when its own list runs dry.
+static void small_free(struct small_page *page, void *ptr) {
+  if (__atomic_load_n(&page->owner, __ATOMIC_RELAXED) !=
+      (uintptr_t)&small_self) {
+    void *head = __atomic_load_n(&page->remote, __ATOMIC_RELAXED);
+    do {
+      *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&page->remote, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return;
+  }
+
+  long i = small_index(page, (uintptr_t)ptr);
+  uint64_t bit = (uint64_t)1 << (i % 64);
+  assert(i >= 0 && (page->alloc[i / 64] & bit));
+
+  page->alloc[i / 64] &= ~bit;
+  page->old[i / 64] &= ~bit;
+  page->used--;
+  *(void **)ptr = page->free;
+  page->free = ptr;
+}
+
+// ========== OBJECT POOL IMPLEMENTATION ==========
+
+// Pool of `obj_size`-byte objects whose payloads are aligned to `align`
+// (a power of two up to the page size; 0 means 8). Objects are ordinary
+// blocks to the collector, so unreachable ones are swept back to the pool.
+struct gc_pool *gc_pool_create(size_t obj_size, size_t align) {
+  if (!align)
+    align = 8;
+  if (!obj_size || align < 8 || (align & (align - 1)) ||
+      align > (size_t)sysconf(_SC_PAGESIZE))
+    return NULL;
+
+  if (!pools) {
+    pools = mmap(NULL, MAX_POOLS * sizeof(*pools), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(pools != MAP_FAILED);
+  }
+  if (pool_count == MAX_POOLS)
+    return NULL;
+
+  // The payload holds the free-list link while the object is free
+  if (obj_size < sizeof(void *))
+    obj_size = sizeof(void *);
+
+  struct gc_pool *pool = &pools[pool_count++];
+  memset(pool, 0, sizeof(*pool));
+  pool->align = align;
+  pool->stride = (META_SIZE + obj_size + align - 1) & ~(align - 1);
+  pool->reclaimed_at = collections;
+  return pool;
+}
+
+void *gc_pool_alloc(struct gc_pool *pool) {
+  struct block_meta *block = pool->free_list;
+  if (!block && !(block = pool_refill(pool)))
+    return NULL;
+
+  void **link = (void **)(block + 1);
+  pool->free_list = *link;
+  *link = NULL; // A stale link would read as a pointer to a free block
+
+  block->free = 0;
+  block->marked = 1;
+  block->magic = 0x77777777;
+  block->flags = BLOCK_POOL;
+  block->descr = NULL;
+  return sampled(block);
+}
+
+// Return an object to its pool: no list walk and no coalescing. free()
+// also accepts pool objects; the pool then finds them after the next gc().
+void gc_pool_free(struct gc_pool *pool, void *ptr) {
+  if (!ptr)
+    return;
+
+  struct block_meta *block = (struct block_meta *)ptr - 1;
+  assert(block->free == 0 && (block->flags & BLOCK_POOL));
+
+  if (block->flags & BLOCK_OLD)
+    old_bytes -= block->size;
+  if (block->flags & BLOCK_FINALIZABLE)
+    drop_finalizer(block, NULL);
+  if (block->flags & BLOCK_SAMPLED)
+    drop_sample(block);
+
+  block->free = 1;
+  block->marked = 0;
+  block->magic = POOL_FREE_MAGIC;
+  *(void **)ptr = pool->free_list;
+  pool->free_list = block;
+}
+
+// Carve a new slab of objects out of a free hole or the top of the heap
+static int pool_grow(struct gc_pool *pool) {
+  // An unaligned first payload needs a front gap big enough to be a block
+  size_t count = POOL_SLAB_SIZE / pool->stride ? POOL_SLAB_SIZE / pool->stride
+                                               : 1;
+  size_t slack = pool->align > 8 ? pool->align + META_SIZE + MIN_SIZE : 0;
+  size_t bytes = count * pool->stride + slack - META_SIZE;
+
+  if (pool->slab_count == pool->slab_capacity) {
+    size_t capacity = pool->slab_capacity ? pool->slab_capacity * 2 : 64;
+    void *slabs =
+        pool->slab_capacity
+            ? mremap(pool->slabs, pool->slab_capacity * sizeof(*pool->slabs),
+                     capacity * sizeof(*pool->slabs), MREMAP_MAYMOVE)
+            : mmap(NULL, capacity * sizeof(*pool->slabs),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slabs == MAP_FAILED)
+      return -1;
+    pool->slabs = slabs;
+    pool->slab_capacity = capacity;
+  }
+
+  struct block_meta *last = NULL;
+  struct block_meta *chunk = global_base ? find_free_block(&last, bytes) : NULL;
+  if (chunk) {
+    split_block(chunk, bytes);
+  } else {
+    chunk = request_space(last, bytes);
+    if (!chunk)
+      return -1;
+    if (!global_base)
+      global_base = chunk;
+  }
+
+  char *start = (char *)chunk;
+  char *end = start + META_SIZE + chunk->size;
+  struct block_meta *after = chunk->next;
+
+  char *first = start;
+  while ((uintptr_t)(first + META_SIZE) & (pool->align - 1) ||
+         (first != start && first - start < (ptrdiff_t)(META_SIZE + MIN_SIZE)))
+    first += 8;
+  count = (size_t)(end - first) / pool->stride;
+
+  // Unaligned front: the chunk header stays as an ordinary free block
+  if (first != start) {
+    chunk->size = (size_t)(first - start) - META_SIZE;
+    chunk->free = 1;
+    chunk->marked = 0;
+    chunk->magic = 0x22222222;
+    chunk->flags = 0;
+    chunk->descr = NULL;
+    chunk->next = (struct block_meta *)first;
+  }
+
+  // Tail too small for a block of its own goes to the last object
+  char *tail = first + count * pool->stride;
+  size_t tail_size = (size_t)(end - tail);
+  if (tail_size >= META_SIZE + MIN_SIZE) {
+    struct block_meta *rest = (struct block_meta *)tail;
+    rest->size = tail_size - META_SIZE;
+    rest->next = after;
+    rest->free = 1;
+    rest->marked = 0;
+    rest->magic = 0x22222222;
+    rest->flags = 0;
+    rest->descr = NULL;
+    after = rest;
+    tail_size = 0;
+  }
+
+  for (size_t i = count; i-- > 0;) {
+    struct block_meta *obj = (struct block_meta *)(first + i * pool->stride);
+    obj->size = pool->stride - META_SIZE + (i == count - 1 ? tail_size : 0);
+    obj->next = i == count - 1 ? after : (struct block_meta *)((char *)obj +
+                                                               pool->stride);
+    obj->free = 1;
+    obj->marked = 0;
+    obj->magic = POOL_FREE_MAGIC;
+    obj->flags = BLOCK_POOL;
+    obj->descr = NULL;
+    *(void **)(obj + 1) = pool->free_list;
+    pool->free_list = obj;
+  }
+
+  pool->slabs[pool->slab_count].first = (struct block_meta *)first;
+  pool->slabs[pool->slab_count].count = count;
+  pool->slab_count++;
+  return 0;
+}
+
+// Objects swept (or passed to free()) since the last pickup go back on the
+// free list; only when there are none is a new slab carved
+static struct block_meta *pool_refill(struct gc_pool *pool) {
+  if (pool->reclaimed_at != collections) {
+    pool->reclaimed_at = collections;
+    for (size_t s = 0; s < pool->slab_count; s++) {
+      struct block_meta *obj = pool->slabs[s].first;
+      for (size_t i = 0; i < pool->slabs[s].count; i++, obj = obj->next) {
+        if (obj->free && obj->magic != POOL_FREE_MAGIC) {
+          obj->magic = POOL_FREE_MAGIC;
+          *(void **)(obj + 1) = pool->free_list;
+          pool->free_list = obj;
+        }
+      }
+    }
+    if (pool->free_list)
+      return pool->free_list;
+  }
+
+  if (pool_grow(pool) != 0)
+    return NULL;
+  return pool->free_list;
+}
+
+// ========== REGION IMPLEMENTATION ==========
+
+// Open a region: objects from gc_region_alloc stay alive (and keep what
+// they reference alive) until gc_region_release frees them all at once
+struct gc_region *gc_region_begin(void) {
+  if (!regions) {
+    regions = mmap(NULL,
+                   MAX_REGIONS * (sizeof(*regions) + sizeof(int)) +
+                       REGION_CACHE * sizeof(*chunk_cache),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(regions != MAP_FAILED);
+    free_regions = (int *)(regions + MAX_REGIONS);
+    chunk_cache = (struct region_chunk **)(free_regions + MAX_REGIONS);
+  }
+
+  struct gc_region *region;
+  if (free_region_count)
+    region = &regions[free_regions[--free_region_count]];
+  else if (region_count < MAX_REGIONS)
+    region = &regions[region_count++];
+  else
+    return NULL;
+
+  memset(region, 0, sizeof(*region));
+  return region;
+}
+
+// Take a new chunk for at least `size` bytes: a cached one if it is big
+// enough, else a fresh atomic block
+static int region_grow(struct gc_region *region, size_t size) {
+  size_t need = sizeof(struct region_chunk) + size;
+  struct region_chunk *chunk = NULL;
+
+  if (chunk_cache_count &&
+      ((struct block_meta *)chunk_cache[chunk_cache_count - 1] - 1)->size >=
+          need)
+    chunk = chunk_cache[--chunk_cache_count];
+  else
+    chunk = gc_malloc_atomic(need > REGION_CHUNK_SIZE ? need
+                                                      : REGION_CHUNK_SIZE);
+  if (!chunk)
+    return -1;
+
+  if (region->chunk)
+    region->chunk->used = region->next;
+  chunk->prev = region->chunk;
+  chunk->used = NULL;
+
+  region->chunk = chunk;
+  region->next = (char *)(chunk + 1);
+  region->end = (char *)chunk + ((struct block_meta *)chunk - 1)->size;
+  return 0;
+}
+
+void *gc_region_alloc(struct gc_region *region, size_t size) {
+  if (!size)
+    return NULL;
+  size = (size + 7) & ~7;
+
+  if (size > (size_t)(region->end - region->next) &&
+      region_grow(region, size) != 0)
+    return NULL;
+
+  void *ptr = region->next;
+  region->next += size;
+  return ptr;
+}
+
+// Free every object of the region. Chunks of the usual size are parked for
+// the next region instead of going through free(); the next collection
+// returns the ones still parked to the heap.
+void gc_region_release(struct gc_region *region) {
+  struct region_chunk *chunk = region->chunk;
+  while (chunk) {
+    struct region_chunk *prev = chunk->prev;
+    if (chunk_cache_count < REGION_CACHE &&
+        ((struct block_meta *)chunk - 1)->size < 2 * REGION_CHUNK_SIZE)
+      chunk_cache[chunk_cache_count++] = chunk;
+    else
+      free(chunk);
+    chunk = prev;
+  }
+
+  memset(region, 0, sizeof(*region));
+  free_regions[free_region_count++] = (int)(region - regions);
+}
+
+// Root a live region: its chunks stay allocated (and in place under
+// gc_compact) and their filled part is scanned conservatively
+static void mark_region(struct gc_region *region) {
+  char *used = region->next;
+  for (struct region_chunk *c = region->chunk; c != NULL; c = c->prev) {
+    struct block_meta *block = (struct block_meta *)c - 1;
+    if (pinning)
+      block->flags |= BLOCK_PINNED;
+    if (!block->marked)
+      push_mark(block);
+
+    scan_region((uintptr_t *)(c + 1), (uintptr_t *)used);
+    if (c->prev)
+      used = c->prev->used;
+  }
+}
+
+// ========== GARBAGE COLLECTOR IMPLEMENTATION ==========
+
+// Set by the dynamic loader to the stack pointer at process entry, just
+// below argv/envp. Weak so a libc without it simply falls back to /proc.
+extern void *__libc_stack_end __attribute__((weak));
+
+// Field 28 of /proc/self/stat is "startstack". Parsed with raw read() so no
+// stdio buffer (and therefore no malloc) is involved.
+static uintptr_t read_proc_stack_bottom(void) {
+  char buf[1024];
+  int fd = open("/proc/self/stat", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+
+  // comm (field 2) may contain spaces, so count fields after its ')'
+  char *p = strrchr(buf, ')');
+  if (!p)
+    return 0;
+  int field = 2;
+  while (*p && field < 28) {
+    if (*p++ == ' ')
+      field++;
+  }
+
+  uintptr_t value = 0;
+  while (*p >= '0' && *p <= '9')
+    value = value * 10 + (uintptr_t)(*p++ - '0');
+  return value;
+}
+
+void gc_init(void) {
+  static int initialized = 0;
+
+  if (initialized)
+    return;
+  initialized = 1;
+
+  if (&__libc_stack_end && __libc_stack_end)
+    stack_bottom = (uintptr_t)__libc_stack_end;
+  else
+    stack_bottom = read_proc_stack_bottom();
+  assert(stack_bottom != 0);
+
+  gc_refresh_data_segments();
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    filter_words = filter_words_avx2;
+  else if (__builtin_cpu_supports("sse4.2"))
+    filter_words = filter_words_sse42;
+#endif
+}
+
+static int read_load_counters(struct dl_phdr_info *info, size_t size,
+                              void *data) {
+  (void)data;
+  if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+    return -1; // Old loader without counters: always rescan
+  if (info->dlpi_adds == loaded_adds && info->dlpi_subs == loaded_subs)
+    return 1;
+  loaded_adds = info->dlpi_adds;
+  loaded_subs = info->dlpi_subs;
+  return -1;
+}
+
+static int collect_data_segments(struct dl_phdr_info *info, size_t size,
+                                 void *data) {
+  (void)size;
+  (void)data;
+
+  // PT_GNU_RELRO is remapped read-only after relocation, so it can never
+  // hold a heap pointer even though it sits inside a writable PT_LOAD
+  uintptr_t relro_start = 0, relro_end = 0;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if (ph->p_type == PT_GNU_RELRO) {
+      relro_start = info->dlpi_addr + ph->p_vaddr;
+      relro_end = relro_start + ph->p_memsz;
+    }
+  }
+
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_W))
+      continue;
+
+    uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+    uintptr_t end = start + ph->p_memsz;
+
+    if (relro_start <= start && relro_end > start)
+      start = relro_end;
+    if (start >= end)
+      continue;
+
+    assert(data_segment_count < MAX_DATA_SEGMENTS);
+    data_segments[data_segment_count].start =
+        (uintptr_t *)WORD_ALIGN_UP(start);
+    data_segments[data_segment_count].end = (uintptr_t *)WORD_ALIGN_DOWN(end);
+    data_segment_count++;
+  }
+  return 0;
+}
+
+void gc_refresh_data_segments(void) {
+  // dlpi_adds/dlpi_subs only change on dlopen/dlclose; checking them
+  // costs one callback, so gc() can call this every cycle
+  if (dl_iterate_phdr(read_load_counters, NULL) == 1)
+    return;
+
+  data_segment_count = 0;
+  dl_iterate_phdr(collect_data_segments, NULL);
+}
+
+int gc_add_roots(void *start, void *end) {
+  if (!start || (char *)end <= (char *)start)
+    return -1;
+  if (root_range_count == MAX_ROOT_RANGES)
+    return -1;
+
+  // Round inwards to word boundaries so scan_region only reads whole words
+  uintptr_t lo = WORD_ALIGN_UP((uintptr_t)start);
+  uintptr_t hi = WORD_ALIGN_DOWN((uintptr_t)end);
+
+  root_ranges[root_range_count].start = (uintptr_t *)lo;
+  root_ranges[root_range_count].end = (uintptr_t *)hi;
+  root_range_count++;
+  return 0;
+}
+
+int gc_remove_roots(void *start, void *end) {
+  uintptr_t lo = WORD_ALIGN_UP((uintptr_t)start);
+  uintptr_t hi = WORD_ALIGN_DOWN((uintptr_t)end);
+
+  // Search from the newest entry: per-request roots are removed LIFO,
+  // which makes add/remove pairs O(1) in practice
+  for (int i = root_range_count - 1; i >= 0; i--) {
+    if ((uintptr_t)root_ranges[i].start == lo &&
+        (uintptr_t)root_ranges[i].end == hi) {
+      // Shift the newer entries down: keeps the table in insertion order,
+      // and a LIFO removal moves nothing
+      memmove(&root_ranges[i], &root_ranges[i + 1],
+              (size_t)(root_range_count - i - 1) * sizeof(root_ranges[0]));
+      root_range_count--;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int gc_add_root(void **ptr) { return gc_add_roots(ptr, ptr + 1); }
+
+int gc_remove_root(void **ptr) { return gc_remove_roots(ptr, ptr + 1); }
+
+void gc_set_interior_policy(int policy, size_t window) {
+  assert(policy >= GC_INTERIOR_ALL && policy <= GC_INTERIOR_BASE);
+  interior_policy = policy;
+  interior_window = policy == GC_INTERIOR_WINDOW ? WORD_ALIGN_DOWN(window) : 0;
+}
+
+static size_t hash_slot(uintptr_t payload, size_t mask) {
+  return (size_t)(((payload >> 3) * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+static void build_block_index(void) {
+  size_t count = 0;
+  for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+    if (!b->free)
+      count++;
+  }
+
+  // Hash at most half full; all three tables share one capacity
+  if (count * 2 > index_capacity) {
+    size_t capacity = 1024;
+    while (capacity < count * 2)
+      capacity *= 2;
+
+    if (index_capacity) {
+      munmap(block_index, 3 * index_capacity * sizeof(struct block_meta *));
+    }
+    void *tables = mmap(NULL, 3 * capacity * sizeof(struct block_meta *),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    assert(tables != MAP_FAILED);
+
+    block_index = tables;
+    interior_index = block_index + capacity;
+    base_hash = interior_index + capacity;
+    index_capacity = capacity;
+  }
+
+  memset(base_hash, 0, index_capacity * sizeof(struct block_meta *));
+  block_index_count = 0;
+  interior_index_count = 0;
+
+  // The block list is address ordered, so both arrays come out sorted
+  for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+    if (b->free)
+      continue;
+
+    block_index[block_index_count++] = b;
+    if (b->flags & BLOCK_INTERIOR)
+      interior_index[interior_index_count++] = b;
+
+    size_t slot = hash_slot((uintptr_t)(b + 1), index_capacity - 1);
+    while (base_hash[slot])
+      slot = (slot + 1) & (index_capacity - 1);
+    base_hash[slot] = b;
+  }
+
+  // Reserved heap: each granule gets the first indexed block that ends
+  // past the granule's start
+  if (reserved_base) {
+    granule_count = (reserved_used + (1 << GRANULE_SHIFT) - 1) >> GRANULE_SHIFT;
+    size_t g = 0;
+    for (size_t i = 0; i < block_index_count; i++) {
+      uintptr_t end = (uintptr_t)(block_index[i] + 1) + block_index[i]->size;
+      while (g < granule_count &&
+             reserved_base + (g << GRANULE_SHIFT) < end)
+        granule_index[g++] = (uint32_t)i;
+    }
+    while (g < granule_count)
+      granule_index[g++] = (uint32_t)block_index_count;
+  }
+}
+
+// Indexed block whose payload contains `value`, found from its granule:
+// only the few blocks sharing that granule are looked at
+static struct block_meta *lookup_granule(uintptr_t value) {
+  size_t g = (value - reserved_base) >> GRANULE_SHIFT;
+  if (value < reserved_base || g >= granule_count)
+    return NULL;
+
+  for (size_t i = granule_index[g]; i < block_index_count; i++) {
+    struct block_meta *block = block_index[i];
+    uintptr_t start = (uintptr_t)(block + 1);
+    if (value < start)
+      return NULL; // In a header or a free block
+    if (value < start + block->size)
+      return block;
+  }
+  return NULL;
+}
+
+static struct block_meta *lookup_base(uintptr_t payload) {
+  size_t slot = hash_slot(payload, index_capacity - 1);
+  while (base_hash[slot]) {
+    if ((uintptr_t)(base_hash[slot] + 1) == payload)
+      return base_hash[slot];
+    slot = (slot + 1) & (index_capacity - 1);
+  }
+  return NULL;
+}
+
+// Binary search a sorted block array for the payload containing `value`
+static struct block_meta *lookup_interior(struct block_meta **blocks,
+                                          size_t count, uintptr_t value) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((uintptr_t)(blocks[mid] + 1) <= value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return NULL;
+
+  struct block_meta *block = blocks[lo - 1];
+  uintptr_t block_start = (uintptr_t)(block + 1);
+  return value < block_start + block->size ? block : NULL;
+}
+
+// Allocated block whose payload contains `value`, whatever the policy
+static struct block_meta *block_containing(uintptr_t value) {
+  return reserved_base
+             ? lookup_granule(value)
+             : lookup_interior(block_index, block_index_count, value);
+}
+
+// Allocated block that `value` references under the interior policy
+static struct block_meta *find_block(uintptr_t value) {
+  if (interior_policy == GC_INTERIOR_ALL)
+    return block_containing(value);
+
+  uintptr_t base = WORD_ALIGN_DOWN(value);
+  for (uintptr_t off = 0; off <= interior_window && off <= base;
+       off += sizeof(uintptr_t)) {
+    struct block_meta *block = lookup_base(base - off);
+    if (block && value < (uintptr_t)(block + 1) + block->size)
+      return block;
+  }
+
+  // Blocks opted in with gc_allow_interior accept any interior address
+  return lookup_interior(interior_index, interior_index_count, value);
+}
+
+size_t gc_false_retained_bytes(void) { return false_retained_bytes; }
+
+static void blacklist_add(uintptr_t addr) {
+  uintptr_t bit = (addr >> BLACKLIST_PAGE_SHIFT) & (BLACKLIST_BITS - 1);
+  blacklist[blacklist_current][bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static int page_blacklisted(int table, uintptr_t addr) {
+  uintptr_t bit = (addr >> BLACKLIST_PAGE_SHIFT) & (BLACKLIST_BITS - 1);
+  return (blacklist[table][bit / 64] >> (bit % 64)) & 1;
+}
+
+// Start of the highest blacklisted page overlapping [start, end), or 0
+static uintptr_t blacklisted_page_in(uintptr_t start, uintptr_t end) {
+  uintptr_t first = start >> BLACKLIST_PAGE_SHIFT;
+  for (uintptr_t page = (end - 1) >> BLACKLIST_PAGE_SHIFT; page >= first;
+       page--) {
+    uintptr_t addr = page << BLACKLIST_PAGE_SHIFT;
+    if (page_blacklisted(0, addr) || page_blacklisted(1, addr))
+      return addr;
+    if (page == 0)
+      break;
+  }
+  return 0;
+}
+
+// First payload address >= `payload` whose `size` bytes avoid blacklisted
+// pages. Any skipped space is large enough to become a free block. The
+// bits are hashed, so a range of BLACKLIST_BITS pages or more covers every
+// one of them and can never be clear: such a range, or one still hit after
+// BLACKLIST_MAX_SKIPS moves, stays where it is.
+static uintptr_t skip_blacklisted(uintptr_t payload, size_t size) {
+  uintptr_t first = payload;
+  uintptr_t hit;
+
+  if (size >= (size_t)BLACKLIST_BITS << BLACKLIST_PAGE_SHIFT)
+    return first;
+
+  for (int skips = 0;
+       (hit = blacklisted_page_in(payload, payload + size)) != 0; skips++) {
+    if (skips == BLACKLIST_MAX_SKIPS)
+      return first;
+    payload = hit + BLACKLIST_PAGE_SIZE;
+    if (payload - first < META_SIZE + MIN_SIZE)
+      payload = first + META_SIZE + MIN_SIZE;
+  }
+  return payload;
+}
+
+// Write the index of each of the `count` (at most FILTER_CHUNK) words that
+// lies in [lo, hi) to `out`; returns how many. Unsigned wrap-around turns
+// the range test into one compare.
+static size_t filter_words_scalar(const uintptr_t *words, size_t count,
+                                  uintptr_t lo, uintptr_t hi, uint16_t *out) {
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    out[n] = (uint16_t)i;
+    n += words[i] - lo < hi - lo;
+  }
+  return n;
+}
+
+#if defined(__x86_64__)
+// The vector kernels test the same wrapped difference. x86 only has a
+// signed 64-bit compare, so both sides are offset by 2^63 first.
+__attribute__((target("sse4.2"))) static size_t
+filter_words_sse42(const uintptr_t *words, size_t count, uintptr_t lo,
+                   uintptr_t hi, uint16_t *out) {
+  const __m128i bias = _mm_set1_epi64x(INT64_MIN);
+  const __m128i low = _mm_set1_epi64x((long long)lo);
+  const __m128i span = _mm_xor_si128(_mm_set1_epi64x((long long)(hi - lo)), bias);
+  size_t n = 0, i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&words[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&words[i + 2]);
+    a = _mm_xor_si128(_mm_sub_epi64(a, low), bias);
+    b = _mm_xor_si128(_mm_sub_epi64(b, low), bias);
+    unsigned mask =
+        (unsigned)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(span, a))) |
+        (unsigned)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(span, b)))
+            << 2;
+    while (mask) {
+      out[n++] = (uint16_t)(i + (size_t)__builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  for (; i < count; i++) {
+    out[n] = (uint16_t)i;
+    n += words[i] - lo < hi - lo;
+  }
+  return n;
+}
+
+__attribute__((target("avx2"))) static size_t
+filter_words_avx2(const uintptr_t *words, size_t count, uintptr_t lo,
+                  uintptr_t hi, uint16_t *out) {
+  const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i low = _mm256_set1_epi64x((long long)lo);
+  const __m256i span =
+      _mm256_xor_si256(_mm256_set1_epi64x((long long)(hi - lo)), bias);
+  size_t n = 0, i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)&words[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)&words[i + 4]);
+    a = _mm256_xor_si256(_mm256_sub_epi64(a, low), bias);
+    b = _mm256_xor_si256(_mm256_sub_epi64(b, low), bias);
+    unsigned mask = (unsigned)_mm256_movemask_pd(
+                        _mm256_castsi256_pd(_mm256_cmpgt_epi64(span, a))) |
+                    (unsigned)_mm256_movemask_pd(
+                        _mm256_castsi256_pd(_mm256_cmpgt_epi64(span, b)))
+                        << 4;
+    while (mask) {
+      out[n++] = (uint16_t)(i + (size_t)__builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  for (; i < count; i++) {
+    out[n] = (uint16_t)i;
+    n += words[i] - lo < hi - lo;
+  }
+  return n;
+}
+#endif
+
+static void scan_region(uintptr_t *start, uintptr_t *end) {
+  if (!global_base)
+    return;
+
+  uintptr_t heap_start = (uintptr_t)(global_base) + META_SIZE;
+  uintptr_t brk = (uintptr_t)heap_sbrk(0);
+  uintptr_t heap_end = brk + BLACKLIST_LOOKAHEAD;
+  uint16_t hits[FILTER_CHUNK];
+
+  // Only words that look like heap pointers get looked up
+  for (uintptr_t *chunk = start; chunk < end; chunk += FILTER_CHUNK) {
+    size_t count = (size_t)(end - chunk);
+    size_t n = filter_words(chunk, count < FILTER_CHUNK ? count : FILTER_CHUNK,
+                            heap_start, heap_end, hits);
+
+    for (size_t h = 0; h < n; h++) {
+      uintptr_t value = chunk[hits[h]];
+
+      // Find which block it points into
+      struct block_meta *block = find_block(value);
+
+      // Nothing allocated there: a false pointer, remember the page.
+      // The break itself is libc's own bookkeeping, and an interior
+      // pointer the policy rejects still lands on live data; neither says
+      // the page attracts false hits.
+      if (!block) {
+        if (value != brk && !(interior_policy != GC_INTERIOR_ALL &&
+                              block_containing(value)))
+          blacklist_add(value);
+        continue;
+      }
+
+      // Small-page objects are marked in their page's bitmap; pages
+      // never move, so there is nothing to pin
+      if (block->magic == SMALL_PAGE_MAGIC) {
+        mark_small(block, value);
+        continue;
+      }
+
+      if (pinning)
+        block->flags |= BLOCK_PINNED; // Ambiguous root: must not move
+
+      if (!block->marked) {
+        push_mark(block); // Mark as reachable
+
+        // Landed on a page that held only false hits last cycle
+        if (page_blacklisted(!blacklist_current, value))
+          false_retained_bytes += block->size;
+      }
+    }
+  }
+}
+
+// Queue an entry for scan_heap: a block, or a small-page object address
+// tagged with bit 0 (objects are SMALL_GRANULE aligned)
+static void push_entry(struct block_meta *entry) {
+  if (mark_stack_top == mark_stack_capacity) {
+    size_t capacity =
+        mark_stack_capacity ? mark_stack_capacity * 2 : MARK_STACK_INITIAL;
+    void *stack =
+        mark_stack_capacity
+            ? mremap(mark_stack, mark_stack_capacity * sizeof(*mark_stack),
+                     capacity * sizeof(*mark_stack), MREMAP_MAYMOVE)
+            : mmap(NULL, capacity * sizeof(*mark_stack),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(stack != MAP_FAILED);
+    mark_stack = stack;
+    mark_stack_capacity = capacity;
+  }
+  mark_stack[mark_stack_top++] = entry;
+}
+
+// Mark a block and queue its contents for scanning
+static void push_mark(struct block_meta *block) {
+  block->marked = 1;
+
+  // Pointer-free blocks (gc_malloc_atomic) are marked but not scanned
+  if (block->flags & BLOCK_ATOMIC)
+    return;
+  push_entry(block);
+}
+
+// Mark the small-page object `value` points into, if it is allocated and
+// the interior policy accepts the offset; returns 1 on a new mark
+static int mark_small(struct block_meta *block, uintptr_t value) {
+  struct small_page *page = (struct small_page *)(block + 1);
+  long i = small_index(page, value);
+  if (i < 0)
+    return 0;
+
+  uintptr_t obj = (uintptr_t)page + SMALL_FIRST_OBJECT + i * page->obj_size;
+  if (interior_policy != GC_INTERIOR_ALL && value - obj > interior_window)
+    return 0;
+
+  uint64_t bit = (uint64_t)1 << (i % 64);
+  if (!(page->alloc[i / 64] & bit) || (page->mark[i / 64] & bit))
+    return 0;
+
+  page->mark[i / 64] |= bit;
+  if (!page->atomic)
+    push_entry((struct block_meta *)(obj | 1));
+  return 1;
+}
+
+// Whether the object `value` points into survived marking
+static int object_marked(struct block_meta *block, uintptr_t value) {
+  if (block->magic != SMALL_PAGE_MAGIC)
+    return block->marked;
+
+  struct small_page *page = (struct small_page *)(block + 1);
+  long i = small_index(page, value);
+  return i >= 0 && ((page->mark[i / 64] >> (i % 64)) & 1);
+}
+
+// Clear a page's mark bits before marking. Minor collections start with
+// the old objects marked, like old blocks: tracing stops at them and the
+// remembered set covers their pointers into the nursery.
+static void start_page_marking(struct block_meta *block, int minor) {
+  struct small_page *page = (struct small_page *)(block + 1);
+  block->marked = 1; // The page itself is reclaimed by sweep_page
+  small_drain(page); // Remote frees must not look allocated to marking
+
+  for (int w = 0; w < (int)SMALL_BITMAP_WORDS; w++)
+    page->mark[w] = minor ? page->alloc[w] & page->old[w] : 0;
+}
+
+// Tenure the page's objects that survived this cycle, returning the bytes
+// promoted. Small objects have no age: one collection is enough. With
+// `remember`, the newly promoted ones are scanned for nursery pointers.
+static size_t promote_page(struct block_meta *block, int remember) {
+  struct small_page *page = (struct small_page *)(block + 1);
+  size_t promoted = 0;
+
+  for (int w = 0; w < (int)SMALL_BITMAP_WORDS; w++) {
+    uint64_t fresh = page->mark[w] & page->alloc[w] & ~page->old[w];
+    page->old[w] |= fresh;
+    promoted += (size_t)__builtin_popcountll(fresh) * page->obj_size;
+
+    while (remember && !page->atomic && fresh) {
+      int i = w * 64 + __builtin_ctzll(fresh);
+      fresh &= fresh - 1;
+      uintptr_t *obj = (uintptr_t *)((uintptr_t)page + SMALL_FIRST_OBJECT +
+                                     i * page->obj_size);
+      for (size_t k = 0; k < page->obj_size / sizeof(uintptr_t); k++)
+        remember_if_young(&obj[k], 0);
+    }
+  }
+  return promoted;
+}
+
+// Free the unmarked objects of a page and rebuild its free list in address
+// order. An empty page that no thread allocates from goes back to the heap.
+static void sweep_page(struct block_meta *block) {
+  struct small_page *page = (struct small_page *)(block + 1);
+
+  page->used = 0;
+  for (int w = 0; w < (int)SMALL_BITMAP_WORDS; w++) {
+    page->alloc[w] &= page->mark[w];
+    page->old[w] &= page->alloc[w];
+    page->used += __builtin_popcountll(page->alloc[w]);
+  }
+
+  if (page->used == 0 && !page->owner) {
+    struct small_page **link =
+        &small_class_pages[page->node][page->atomic]
+                          [page->obj_size / SMALL_GRANULE - 1];
+    while (*link != page)
+      link = &(*link)->next;
+    *link = page->next;
+    small_map[((uintptr_t)page - small_map_base) >> SMALL_PAGE_SHIFT] = 0;
+
+    block->free = 1;
+    block->marked = 0;
+    block->magic = 0x55555555;
+    block->flags = 0;
+    return;
+  }
+
+  page->free = NULL;
+  for (int i = page->count; i-- > 0;) {
+    if ((page->alloc[i / 64] >> (i % 64)) & 1)
+      continue;
+    void **obj = (void **)((uintptr_t)page + SMALL_FIRST_OBJECT +
+                           i * page->obj_size);
+    *obj = page->free;
+    page->free = obj;
+  }
+}
+
+// Mark the unmarked block `value` points into; returns 1 on a new mark.
+// `precise` is 0 when the word is only possibly a pointer.
+static int mark_pointer(uintptr_t value, int precise) {
+  struct block_meta *other = find_block(value);
+
+  if (other && other->magic == SMALL_PAGE_MAGIC)
+    return mark_small(other, value);
+
+  if (other && pinning && !precise)
+    other->flags |= BLOCK_PINNED;
+
+  if (other && !other->marked) {
+    push_mark(other);
+    return 1;
+  }
+  return 0;
+}
+
+// Call `visit` on every word of the block that may hold a pointer, telling
+// it whether a type descriptor guarantees the word is one
+static void scan_block(struct block_meta *block,
+                       void (*visit)(uintptr_t *, int)) {
+  if (block->flags & BLOCK_ATOMIC)
+    return;
+
+  uintptr_t *data = (uintptr_t *)(block + 1);
+  size_t word_count = block->size / sizeof(uintptr_t);
+
+  if (block->descr) {
+    // Precise: visit only the pointer slots of each element
+    size_t stride = block->descr->words;
+    for (size_t base = 0; base + stride <= word_count; base += stride) {
+      uintptr_t bits = block->descr->bitmap;
+      while (bits) {
+        size_t i = (size_t)__builtin_ctzl(bits);
+        bits &= bits - 1;
+        visit(&data[base + i], 1);
+      }
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < word_count; i++) {
+    visit(&data[i], 0);
+  }
+}
+
+// Start loading what marking `value` will touch: the page's bitmap words
+// for a small object, else the header just below it, which is where it
+// lies for the usual pointer to a payload's start, and the first words
+// scanned once it is marked. A wrong guess for an interior pointer costs
+// a useless load, never a fault.
+static void prefetch_target(uintptr_t value) {
+  struct small_page *page = small_page_of((const void *)value);
+  if (page) {
+    long i = small_index(page, value);
+    if (i >= 0) {
+      __builtin_prefetch(&page->alloc[i / 64], 0);
+      __builtin_prefetch(&page->mark[i / 64], 1);
+      __builtin_prefetch((void *)value, 0); // Scanned once marked
+    }
+    return;
+  }
+  __builtin_prefetch((struct block_meta *)WORD_ALIGN_DOWN(value) - 1, 1);
+  __builtin_prefetch((void *)value, 0);
+}
+
+// Mark the candidate that has been in the FIFO the longest
+static void mark_oldest_candidate(void) {
+  size_t slot = mark_prefetch_head;
+  mark_prefetch_head = (mark_prefetch_head + 1) % MARK_PREFETCH_DEPTH;
+  mark_prefetch_count--;
+  mark_pointer(mark_prefetch[slot].value, mark_prefetch[slot].precise);
+}
+
+// Queue a word that may point into the heap behind the prefetch of its
+// target, marking the oldest one once the FIFO is full
+static void queue_candidate(uintptr_t value, int precise) {
+  if (mark_prefetch_count == MARK_PREFETCH_DEPTH)
+    mark_oldest_candidate();
+  prefetch_target(value);
+
+  size_t tail =
+      (mark_prefetch_head + mark_prefetch_count) % MARK_PREFETCH_DEPTH;
+  mark_prefetch[tail].value = value;
+  mark_prefetch[tail].precise = precise;
+  mark_prefetch_count++;
+}
+
+// scan_heap's visitor for blocks with a type descriptor
+static void prefetch_slot(uintptr_t *slot, int precise) {
+  uintptr_t value = *slot;
+  if (value - mark_heap_start < mark_heap_end - mark_heap_start)
+    queue_candidate(value, precise);
+}
+
+// Queue the words of a conservatively scanned object that fall in the heap
+static void scan_words(const uintptr_t *words, size_t count) {
+  uint16_t hits[FILTER_CHUNK];
+  for (size_t base = 0; base < count; base += FILTER_CHUNK) {
+    size_t n = filter_words(words + base,
+                            count - base < FILTER_CHUNK ? count - base
+                                                        : FILTER_CHUNK,
+                            mark_heap_start, mark_heap_end, hits);
+    for (size_t h = 0; h < n; h++)
+      queue_candidate(words[base + hits[h]], 0);
+  }
+}
+
+// Compute transitive closure: every block on the stack is already marked,
+// so each reachable block is scanned exactly once. Candidates still in the
+// prefetch FIFO when the stack runs dry are marked before stopping.
+static void scan_heap(void) {
+  if (!global_base)
+    return;
+  mark_heap_start = (uintptr_t)(global_base) + META_SIZE;
+  mark_heap_end = (uintptr_t)heap_sbrk(0);
+
+  while (mark_stack_top > 0 || mark_prefetch_count > 0) {
+    if (mark_stack_top == 0) {
+      mark_oldest_candidate();
+      continue;
+    }
+    struct block_meta *block = mark_stack[--mark_stack_top];
+
+    // Tagged entry: a small-page object, always scanned conservatively
+    if ((uintptr_t)block & 1) {
+      uintptr_t *obj = (uintptr_t *)((uintptr_t)block & ~(uintptr_t)1);
+      struct small_page *page =
+          (struct small_page *)((uintptr_t)obj & ~(SMALL_PAGE_SIZE - 1));
+      scan_words(obj, page->obj_size / sizeof(uintptr_t));
+      continue;
+    }
+    if (block->descr || (block->flags & BLOCK_ATOMIC))
+      scan_block(block, prefetch_slot);
+    else
+      scan_words((uintptr_t *)(block + 1), block->size / sizeof(uintptr_t));
+  }
+  memset(mark_prefetch, 0, sizeof(mark_prefetch));
+  mark_heap_start = mark_heap_end = 0;
+}
+
+// Separate frame so everything gc() spilled lies above our frame address.
+// Reading %rbp in gc() itself breaks under -fomit-frame-pointer.
+static __attribute__((noinline)) void scan_stack(void) {
+  uintptr_t stack_top = (uintptr_t)__builtin_frame_address(0);
+  scan_region((uintptr_t *)stack_top, (uintptr_t *)stack_bottom);
+}
+
+void gc(void) {
+  if (generational && !remembered_overflow &&
+      old_bytes - old_bytes_at_full <= full_growth)
+    collect(1);
+  else
+    collect(0);
+}
+
+void gc_full(void) { collect(0); }
+
+// Minor collections mark only young blocks: old blocks start out marked, so
+// tracing stops at them and only the remembered set leads into the nursery
+static void collect(int minor) {
+  if (!global_base)
+    return;
+
+  build_block_index();
+
+  struct block_meta *block = global_base;
+  for (; block != NULL; block = block->next) {
+    block->marked = minor && (block->flags & BLOCK_OLD) && !block->free;
+    if (block->magic == SMALL_PAGE_MAGIC)
+      start_page_marking(block, minor);
+  }
+
+  // Start a new blacklist generation; the previous one is kept
+  blacklist_current = !blacklist_current;
+  memset(blacklist[blacklist_current], 0, sizeof(blacklist[0]));
+  false_retained_bytes = 0;
+
+  // Mark phase: Scan data/BSS of the executable and all shared objects
+  gc_refresh_data_segments();
+  for (int i = 0; i < data_segment_count; i++) {
+    scan_region(data_segments[i].start, data_segments[i].end);
+  }
+
+  // Scan stack: spill callee-saved registers into this frame first, since
+  // with optimisation a live pointer may exist only in a register
+  __builtin_unwind_init();
+  scan_stack();
+
+  // Scan user-registered roots (mmap regions, TLS, foreign allocators...)
+  for (int i = 0; i < root_range_count; i++) {
+    scan_region(root_ranges[i].start, root_ranges[i].end);
+  }
+
+  // Live regions; parked chunks are left unmarked and swept
+  for (size_t i = 0; i < region_count; i++) {
+    if (regions[i].chunk)
+      mark_region(&regions[i]);
+  }
+  chunk_cache_count = 0;
+
+  // Handles are precise: they never pin
+  for (size_t i = 0; i < handle_count; i++) {
+    mark_pointer((uintptr_t)handles[i], 1);
+  }
+
+  // Objects waiting for their finalizer, and every finalizer's argument
+  pthread_mutex_lock(&finalize_lock);
+  for (size_t i = finalize_head; i != finalize_tail;
+       i = (i + 1) % MAX_FINALIZERS) {
+    mark_pointer((uintptr_t)(finalize_queue[i].block + 1), 1);
+    mark_pointer((uintptr_t)finalize_queue[i].data, 0);
+  }
+  pthread_mutex_unlock(&finalize_lock);
+  for (size_t i = 0; i < finalizer_count; i++) {
+    mark_pointer((uintptr_t)finalizers[i].data, 0);
+  }
+
+  // Old-to-young pointers recorded by the write barrier. The barrier
+  // records any heap slot; those outside live old objects are dropped here.
+  if (minor) {
+    size_t kept = 0;
+    for (size_t i = 0; i < remembered_count; i++) {
+      if (!slot_in_old(remembered[i]))
+        continue;
+      remembered[kept++] = remembered[i];
+      mark_pointer(*remembered[i], 0);
+    }
+    remembered_count = kept;
+  }
+
+  // Scan heap for pointer chains
   scan_heap();
 
-  // Sweep phase: Free unmarked blocks
-  block = global_base;
-  while (block != NULL) {
-    struct block_meta *next = block->next;
+  // Weak references die before finalization resurrects their target
+  if (weak_count)
+    clear_weak_refs();
+
+  // Resurrect unreachable finalizable objects (and what they reference)
+  // until their finalizer has run
+  if (finalizer_count) {
+    queue_finalizers();
+    scan_heap();
+  }
+
+  if (generational)
+    update_generations(minor);
+
+  // Sweep phase: Free unmarked blocks
+  block = global_base;
+  refill_cursor = NULL;
+  while (block != NULL) {
+    struct block_meta *next = block->next;
+
+    if (block->magic == SMALL_PAGE_MAGIC) {
+      sweep_page(block);
+    } else if (!block->marked && !block->free) {
+      if (block->flags & BLOCK_SAMPLED)
+        drop_sample(block);
+      block->free = 1;
+      block->marked = 0;
+      block->magic = 0x55555555;
+    }
+
+    block = next;
+  }
+  collections++;
+
+  trim_top(trim_threshold);
+  scavenge(scavenge_target, SCAVENGE_BATCH);
+}
+
+void gc_enable_generational(int age, size_t growth) {
+  if (!remembered) {
+    remembered = mmap(NULL, MAX_REMEMBERED * sizeof(*remembered),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+    assert(remembered != MAP_FAILED);
+  }
+
+  promote_age = age > 0 ? age : DEFAULT_PROMOTE_AGE;
+  if (promote_age > BLOCK_AGE_MAX)
+    promote_age = BLOCK_AGE_MAX; // Ages below it must fit the flag bits
+  full_growth = growth ? growth : DEFAULT_FULL_GROWTH;
+  generational = 1;
+
+  // Nothing is old yet, so nothing has to be remembered
+  remembered_count = 0;
+  remembered_overflow = 0;
+}
+
+void gc_write_barrier(void *slot) {
+  if (!generational || !global_base)
+    return;
+
+  // Only heap slots can belong to an old object; roots are scanned anyway
+  if ((uintptr_t)slot < (uintptr_t)global_base || slot >= heap_sbrk(0))
+    return;
+
+  if (remembered_count && remembered[remembered_count - 1] == slot)
+    return;
+
+  if (remembered_count == MAX_REMEMBERED) {
+    remembered_overflow = 1; // Next gc() has to be a full collection
+    return;
+  }
+  remembered[remembered_count++] = slot;
+}
+
+size_t gc_old_generation_bytes(void) { return old_bytes; }
+
+// Whether the remembered `slot` lies in a live old object. Only those are
+// roots into the nursery: a young holder is traced like any other young
+// object, and a dead or freed one must not keep its referents alive.
+static int slot_in_old(uintptr_t *slot) {
+  uintptr_t addr = (uintptr_t)slot;
+  struct block_meta *holder = block_containing(addr);
+  if (!holder || holder->free || !holder->marked)
+    return 0;
+  if (holder->magic != SMALL_PAGE_MAGIC)
+    return (holder->flags & BLOCK_OLD) != 0;
+
+  struct small_page *page = (struct small_page *)(holder + 1);
+  long i = small_index(page, addr);
+  return i >= 0 && ((page->alloc[i / 64] & page->old[i / 64]) >> (i % 64) & 1);
+}
+
+// Whether `value` references a block that stays young after this cycle
+static int points_to_young(uintptr_t value) {
+  struct block_meta *target = find_block(value);
+  if (target && target->magic == SMALL_PAGE_MAGIC) {
+    struct small_page *page = (struct small_page *)(target + 1);
+    long i = small_index(page, value);
+    return i >= 0 && ((page->mark[i / 64] & ~page->old[i / 64]) >> (i % 64) & 1);
+  }
+  return target && target->marked && !(target->flags & BLOCK_OLD);
+}
+
+static void remember_if_young(uintptr_t *slot, int precise) {
+  (void)precise;
+  if (!points_to_young(*slot))
+    return;
+  if (remembered_count == MAX_REMEMBERED)
+    remembered_overflow = 1;
+  else
+    remembered[remembered_count++] = slot;
+}
+
+static void update_generations(int minor) {
+  struct block_meta *block;
+
+  // Everything that survives a full collection is tenured, so there is no
+  // nursery left and no old-to-young pointer to remember
+  if (!minor) {
+    old_bytes = 0;
+    for (block = global_base; block != NULL; block = block->next) {
+      if (block->magic == SMALL_PAGE_MAGIC) {
+        struct small_page *page = (struct small_page *)(block + 1);
+        memset(page->old, 0, sizeof(page->old));
+        old_bytes += promote_page(block, 0);
+      } else if (block->marked && !block->free) {
+        block->flags |= BLOCK_OLD;
+        old_bytes += block->size;
+      }
+    }
+    old_bytes_at_full = old_bytes;
+    remembered_count = 0;
+    remembered_overflow = 0;
+    return;
+  }
+
+  // Age the nursery survivors and promote those old enough
+  for (block = global_base; block != NULL; block = block->next) {
+    if (block->magic == SMALL_PAGE_MAGIC || !block->marked || block->free ||
+        (block->flags & BLOCK_OLD))
+      continue;
+
+    int age = BLOCK_AGE(block) + 1;
+    block->flags &= ~(BLOCK_AGE_MAX << BLOCK_AGE_SHIFT);
+    if (age >= promote_age) {
+      block->flags |= BLOCK_OLD | BLOCK_PROMOTED;
+      old_bytes += block->size;
+    } else {
+      block->flags |= age << BLOCK_AGE_SHIFT;
+    }
+  }
+
+  // Small survivors are all promoted now that the blocks have their ages,
+  // so their pointers to blocks that stay young can be told apart
+  for (block = global_base; block != NULL; block = block->next) {
+    if (block->magic == SMALL_PAGE_MAGIC)
+      old_bytes += promote_page(block, 1);
+  }
+
+  // Keep remembered slots of surviving old objects that still lead into
+  // the nursery; the sweep is about to free the holders of the others
+  size_t kept = 0;
+  for (size_t i = 0; i < remembered_count; i++) {
+    if (slot_in_old(remembered[i]) && points_to_young(*remembered[i]))
+      remembered[kept++] = remembered[i];
+  }
+  remembered_count = kept;
+
+  // Newly promoted blocks may hold the only pointers to younger survivors
+  for (block = global_base; block != NULL; block = block->next) {
+    if (block->flags & BLOCK_PROMOTED) {
+      block->flags &= ~BLOCK_PROMOTED;
+      scan_block(block, remember_if_young);
+    }
+  }
+}
+
+void **gc_new_handle(void *ptr) {
+  if (!handles) {
+    handles = mmap(NULL, MAX_HANDLES * (sizeof(*handles) + sizeof(int)),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(handles != MAP_FAILED);
+    free_handles = (int *)(handles + MAX_HANDLES);
+  }
+
+  void **handle;
+  if (free_handle_count)
+    handle = &handles[free_handles[--free_handle_count]];
+  else if (handle_count < MAX_HANDLES)
+    handle = &handles[handle_count++];
+  else
+    return NULL;
+
+  *handle = ptr;
+  return handle;
+}
+
+void gc_free_handle(void **handle) {
+  if (!handle)
+    return;
+  *handle = NULL;
+  free_handles[free_handle_count++] = (int)(handle - handles);
+}
+
+int gc_register_finalizer(void *ptr, void (*fn)(void *, void *),
+                          void *data) {
+  if (!ptr || !fn)
+    return -1;
+
+  if (!finalizers) {
+    finalizers = mmap(NULL, 2 * MAX_FINALIZERS * sizeof(struct finalizer),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+    assert(finalizers != MAP_FAILED);
+    finalize_queue = finalizers + MAX_FINALIZERS;
+  }
+
+  if (small_page_of(ptr))
+    return -1; // No header to flag
+
+  struct block_meta *block = (struct block_meta *)ptr - 1;
+  if (block->flags & BLOCK_FINALIZABLE)
+    drop_finalizer(block, NULL); // Re-registering replaces the old one
+
+  if (finalizer_count == MAX_FINALIZERS)
+    return -1;
+
+  finalizers[finalizer_count].block = block;
+  finalizers[finalizer_count].fn = fn;
+  finalizers[finalizer_count].data = data;
+  finalizer_count++;
+  block->flags |= BLOCK_FINALIZABLE;
+  return 0;
+}
+
+// Remove the registration for `block`, or move it to `moved` (realloc)
+static void drop_finalizer(struct block_meta *block, struct block_meta *moved) {
+  for (size_t i = 0; i < finalizer_count; i++) {
+    if (finalizers[i].block != block)
+      continue;
+
+    block->flags &= ~BLOCK_FINALIZABLE;
+    if (moved) {
+      finalizers[i].block = moved;
+      moved->flags |= BLOCK_FINALIZABLE;
+    } else {
+      finalizers[i] = finalizers[--finalizer_count];
+    }
+    return;
+  }
+}
+
+// Move registrations of unmarked objects to the run queue and mark them.
+// With the queue full an object stays registered and is only marked: it
+// survives this cycle and is queued by a later one.
+static void queue_finalizers(void) {
+  int queued = 0;
+
+  pthread_mutex_lock(&finalize_lock);
+  for (size_t i = 0; i < finalizer_count;) {
+    struct block_meta *block = finalizers[i].block;
+    size_t next_tail = (finalize_tail + 1) % MAX_FINALIZERS;
+
+    if (block->marked) {
+      i++;
+      continue;
+    }
+    if (next_tail == finalize_head) {
+      push_mark(block);
+      i++;
+      continue;
+    }
+
+    block->flags &= ~BLOCK_FINALIZABLE;
+    finalize_queue[finalize_tail] = finalizers[i];
+    finalize_tail = next_tail;
+    finalizers[i] = finalizers[--finalizer_count];
+    push_mark(block);
+    queued = 1;
+  }
+  if (queued)
+    pthread_cond_signal(&finalize_ready);
+  pthread_mutex_unlock(&finalize_lock);
+}
+
+// Run queued finalizers on the calling thread; returns how many ran. An
+// entry leaves the queue only after its finalizer returns, so the object
+// stays marked while the finalizer uses it.
+int gc_run_finalizers(void) {
+  int ran = 0;
+
+  pthread_mutex_lock(&finalize_run_lock);
+  for (;;) {
+    pthread_mutex_lock(&finalize_lock);
+    if (finalize_head == finalize_tail) {
+      pthread_mutex_unlock(&finalize_lock);
+      break;
+    }
+    struct finalizer entry = finalize_queue[finalize_head];
+    pthread_mutex_unlock(&finalize_lock);
+
+    entry.fn(entry.block + 1, entry.data);
+
+    pthread_mutex_lock(&finalize_lock);
+    finalize_head = (finalize_head + 1) % MAX_FINALIZERS;
+    pthread_mutex_unlock(&finalize_lock);
+    ran++;
+  }
+  pthread_mutex_unlock(&finalize_run_lock);
+
+  return ran;
+}
+
+static void *finalizer_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&finalize_lock);
+    while (finalize_head == finalize_tail)
+      pthread_cond_wait(&finalize_ready, &finalize_lock);
+    pthread_mutex_unlock(&finalize_lock);
+
+    gc_run_finalizers();
+  }
+  return NULL;
+}
+
+// Run finalizers on a background thread instead of gc_run_finalizers().
+// The allocator takes no locks, so finalizers running there must not call
+// malloc/free unless the application serialises allocation itself.
+int gc_start_finalizer_thread(void) {
+  if (finalizer_thread_started)
+    return 0;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, finalizer_thread, NULL) != 0)
+    return -1;
+  pthread_detach(thread);
+  finalizer_thread_started = 1;
+  return 0;
+}
+
+static struct gc_weak *new_weak(void *obj, void **link) {
+  if (!obj)
+    return NULL;
 
-    if (!block->marked && !block->free) {
+  if (!weak_refs) {
+    weak_refs = mmap(NULL, MAX_WEAK * (sizeof(struct gc_weak) + sizeof(int)),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                     0);
+    assert(weak_refs != MAP_FAILED);
+    free_weak = (int *)(weak_refs + MAX_WEAK);
+  }
+
+  struct gc_weak *weak;
+  if (free_weak_count)
+    weak = &weak_refs[free_weak[--free_weak_count]];
+  else if (weak_count < MAX_WEAK)
+    weak = &weak_refs[weak_count++];
+  else
+    return NULL;
+
+  weak->hidden = GC_HIDE_POINTER(obj);
+  weak->link = link;
+  return weak;
+}
+
+static void release_weak(struct gc_weak *weak) {
+  weak->hidden = 0;
+  weak->link = NULL;
+  free_weak[free_weak_count++] = (int)(weak - weak_refs);
+}
+
+struct gc_weak *gc_weak_create(void *ptr) { return new_weak(ptr, NULL); }
+
+void *gc_weak_get(struct gc_weak *weak) {
+  return weak && weak->hidden ? GC_REVEAL_POINTER(weak->hidden) : NULL;
+}
+
+void gc_weak_destroy(struct gc_weak *weak) {
+  if (weak)
+    release_weak(weak);
+}
+
+// `*link` is set to NULL once `obj` is unreachable. The slot must not be
+// scanned as a pointer itself: keep it in an atomic block, omit it from the
+// block's descriptor, or store GC_HIDE_POINTER(obj) in it.
+int gc_register_disappearing_link(void **link, void *obj) {
+  return link && new_weak(obj, link) ? 0 : -1;
+}
+
+int gc_unregister_disappearing_link(void **link) {
+  for (size_t i = 0; i < weak_count; i++) {
+    if (weak_refs[i].link == link && weak_refs[i].hidden) {
+      release_weak(&weak_refs[i]);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Called between marking and sweeping
+static void clear_weak_refs(void) {
+  for (size_t i = 0; i < weak_count; i++) {
+    struct gc_weak *weak = &weak_refs[i];
+    if (!weak->hidden)
+      continue;
+
+    // A link inside a dying block goes away with it
+    if (weak->link) {
+      struct block_meta *holder = lookup_interior(
+          block_index, block_index_count, (uintptr_t)weak->link);
+      if (holder && !object_marked(holder, (uintptr_t)weak->link)) {
+        release_weak(weak);
+        continue;
+      }
+    }
+
+    uintptr_t obj = (uintptr_t)GC_REVEAL_POINTER(weak->hidden);
+    struct block_meta *target = find_block(obj);
+    if (target && object_marked(target, obj))
+      continue;
+
+    weak->hidden = 0;
+    if (weak->link) {
+      *weak->link = NULL;
+      release_weak(weak); // A cleared link needs no further tracking
+    }
+  }
+}
+
+// Forwarded address of `value`, or `value` if it is not in a moved block
+static uintptr_t forward_pointer(struct forwarding *table, size_t count,
+                                 uintptr_t value) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (table[mid].from <= value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo && value < table[lo - 1].from + table[lo - 1].size)
+    return table[lo - 1].to + (value - table[lo - 1].from);
+  return value;
+}
+
+// Mostly-copying compaction: after a full collection, blocks reached only
+// through typed slots and handles slide down into lower free holes. Blocks
+// hit by the stack, data segments, registered roots or conservatively
+// scanned heap words are pinned, since those words cannot be rewritten.
+void gc_compact(struct gc_compact_stats *stats) {
+  struct gc_compact_stats local = {0};
+  if (!stats)
+    stats = &local;
+  memset(stats, 0, sizeof(*stats));
+
+  if (!global_base)
+    return;
+
+  pinning = 1;
+  collect(0);
+  pinning = 0;
+
+  merge_free_blocks(global_base);
+  stats->fragmentation_before = heap_fragmentation();
+
+  size_t candidates = 0, hole_count = 0;
+  for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+    if (b->free) {
+      hole_count += !(b->flags & BLOCK_UNSHARED);
+      continue;
+    }
+    if (b->flags & BLOCK_PINNED)
+      stats->pinned_blocks++;
+    else if (!(b->flags & BLOCK_POOL) && b->magic != SMALL_PAGE_MAGIC)
+      candidates++; // Pool objects and small pages never move
+  }
+
+  if (candidates) {
+    size_t bytes = (candidates + hole_count) * sizeof(struct block_meta *) +
+                   candidates * sizeof(struct forwarding);
+    struct block_meta **movable = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(movable != MAP_FAILED);
+    struct block_meta **holes = movable + candidates;
+    struct forwarding *table = (struct forwarding *)(holes + hole_count);
+
+    // Free holes in address order: a filled one leaves its split-off rest
+    // in its entry, or NULL, so no search walks the allocated blocks
+    size_t n = 0, h = 0;
+    for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+      if (b->free && !(b->flags & BLOCK_UNSHARED))
+        holes[h++] = b;
+      else if (!b->free && !(b->flags & (BLOCK_PINNED | BLOCK_POOL)) &&
+               b->magic != SMALL_PAGE_MAGIC)
+        movable[n++] = b;
+    }
+    size_t first_hole = 0; // Entries before it are all used up
+
+    // Highest blocks first, each into the lowest hole that fits
+    size_t moved = 0;
+    for (size_t i = n; i-- > 0;) {
+      struct block_meta *block = movable[i];
+      while (first_hole < hole_count && !holes[first_hole])
+        first_hole++;
+      size_t j = first_hole;
+      while (j < hole_count &&
+             (!holes[j] || (holes[j] < block &&
+                            !block_fits(holes[j], block->size))))
+        j++;
+      if (j == hole_count || holes[j] >= block)
+        continue;
+
+      struct block_meta *hole = holes[j];
+      int split = hole->size >= block->size + META_SIZE + MIN_SIZE;
+      split_block(hole, block->size);
+      holes[j] = split ? hole->next : NULL;
+      hole->free = 0;
+      hole->marked = 1;
+      hole->magic = 0x77777777;
+      hole->flags = block->flags;
+      hole->descr = block->descr;
+      if (block->flags & BLOCK_SAMPLED)
+        samples[BLOCK_SAMPLE(block)].block = hole;
+      memcpy(hole + 1, block + 1, block->size);
+
+      table[moved].from = (uintptr_t)(block + 1);
+      table[moved].to = (uintptr_t)(hole + 1);
+      table[moved].size = block->size;
+      moved++;
+
+      stats->moved_bytes += block->size;
       block->free = 1;
       block->marked = 0;
       block->magic = 0x55555555;
+      block->flags = 0;
+      block->descr = NULL;
     }
+    stats->moved_blocks = moved;
 
-    block = next;
+    // Entries were made from high to low addresses: reverse for searching
+    for (size_t i = 0; i < moved / 2; i++) {
+      struct forwarding tmp = table[i];
+      table[i] = table[moved - 1 - i];
+      table[moved - 1 - i] = tmp;
+    }
+
+    // Rewrite every precise reference to a moved block
+    if (moved) {
+      for (size_t i = 0; i < handle_count; i++) {
+        handles[i] =
+            (void *)forward_pointer(table, moved, (uintptr_t)handles[i]);
+      }
+
+      for (size_t i = 0; i < finalizer_count; i++) {
+        uintptr_t obj = (uintptr_t)(finalizers[i].block + 1);
+        finalizers[i].block =
+            (struct block_meta *)forward_pointer(table, moved, obj) - 1;
+      }
+      for (size_t i = finalize_head; i != finalize_tail;
+           i = (i + 1) % MAX_FINALIZERS) {
+        uintptr_t obj = (uintptr_t)(finalize_queue[i].block + 1);
+        finalize_queue[i].block =
+            (struct block_meta *)forward_pointer(table, moved, obj) - 1;
+      }
+
+      // Weak targets never pin, so they move like any other block
+      for (size_t i = 0; i < weak_count; i++) {
+        struct gc_weak *weak = &weak_refs[i];
+        if (!weak->hidden)
+          continue;
+
+        uintptr_t obj = (uintptr_t)GC_REVEAL_POINTER(weak->hidden);
+        uintptr_t to = forward_pointer(table, moved, obj);
+        weak->hidden = GC_HIDE_POINTER(to);
+
+        if (weak->link) {
+          weak->link = (void **)forward_pointer(table, moved,
+                                                (uintptr_t)weak->link);
+          if ((uintptr_t)*weak->link == obj)
+            *weak->link = (void *)to;
+          else if ((uintptr_t)*weak->link == GC_HIDE_POINTER(obj))
+            *weak->link = (void *)GC_HIDE_POINTER(to);
+        }
+      }
+
+      for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+        if (b->free || (b->flags & BLOCK_ATOMIC) || !b->descr)
+          continue;
+
+        uintptr_t *data = (uintptr_t *)(b + 1);
+        size_t word_count = b->size / sizeof(uintptr_t);
+        size_t stride = b->descr->words;
+        for (size_t base = 0; base + stride <= word_count; base += stride) {
+          uintptr_t bits = b->descr->bitmap;
+          while (bits) {
+            size_t w = (size_t)__builtin_ctzl(bits);
+            bits &= bits - 1;
+            data[base + w] = forward_pointer(table, moved, data[base + w]);
+          }
+        }
+      }
+    }
+
+    munmap(movable, bytes);
+  }
+
+  for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+    b->flags &= ~BLOCK_PINNED;
+  }
+
+  merge_free_blocks(global_base);
+  trim_top(trim_threshold);
+  stats->fragmentation_after = heap_fragmentation();
+}
+
+// ========== HEAP PROFILER IMPLEMENTATION ==========
+
+// Start sampling one allocation per `rate` bytes on average (0: default).
+// Samples already taken are kept.
+void gc_profile_start(size_t rate) {
+  pthread_mutex_lock(&profile_lock);
+  if (!samples) {
+    samples = mmap(NULL, MAX_SAMPLES * sizeof(*samples),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(samples != MAP_FAILED);
+  }
+  profile_rate = rate ? rate : PROFILE_DEFAULT_RATE;
+  sample_countdown = 0; // Other threads pick up the rate after one sample
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// Stop taking samples. Live ones stay in the profile until their block is
+// freed or collected.
+void gc_profile_stop(void) {
+  profile_rate = 0;
+}
+
+static uint64_t sample_random(void) {
+  sample_seed ^= sample_seed << 13;
+  sample_seed ^= sample_seed >> 7;
+  sample_seed ^= sample_seed << 17;
+  return sample_seed;
+}
+
+// log2 from the exponent bits plus a quadratic fit of the mantissa; the
+// sampler only needs a few digits and libm is not linked
+static double fast_log2(double x) {
+  union {
+    double d;
+    uint64_t u;
+  } v = {x};
+  int exponent = (int)((v.u >> 52) & 0x7ff) - 1023;
+  v.u = (v.u & ((1ull << 52) - 1)) | (1023ull << 52); // Mantissa in [1, 2)
+  return exponent + (-0.34484843 * v.d + 2.02466578) * v.d - 1.67487759;
+}
+
+// Bytes until the next sample: exponentially distributed with mean
+// profile_rate, so every allocated byte is equally likely to be picked
+static intptr_t next_sample_interval(void) {
+  double u = (double)((sample_random() >> 11) + 1) / (double)(1ull << 53);
+  double interval = -fast_log2(u) * 0.6931471805599453 * (double)profile_rate;
+  return interval < 1.0 ? 1 : (intptr_t)interval;
+}
+
+// Bytes represented by a sample of `size`: a block is sampled with
+// probability 1 - exp(-size / rate)
+static size_t sample_weight(size_t size, size_t rate) {
+  double x = (double)size / (double)rate;
+  if (x >= 32.0)
+    return size;
+
+  double p;
+  if (x < 0.5) {
+    p = x * (1.0 - x / 2.0 * (1.0 - x / 3.0)); // Series of 1 - exp(-x)
+  } else {
+    // exp(-x) = 2^-(k + f), with 2^-f from a quadratic fit on [0, 1)
+    double y = x * 1.4426950408889634;
+    int k = (int)y;
+    double f = y - k;
+    double e = 1.0 / ((0.3435 * f + 0.6565) * f + 1.0);
+    p = 1.0 - e / (double)(1ull << k);
+  }
+  return (size_t)((double)size / p);
+}
+
+// Return addresses from the frame pointer chain, innermost first. The
+// chain is trusted only while frames move toward the stack bottom in
+// plausible steps.
+static __attribute__((noinline)) int capture_backtrace(uintptr_t *pcs,
+                                                       int max) {
+  uintptr_t *fp = __builtin_frame_address(0);
+  int depth = 0;
+
+  while (depth < max) {
+    uintptr_t *next = (uintptr_t *)fp[0];
+    uintptr_t pc = fp[1];
+    if (!pc)
+      break;
+    pcs[depth++] = pc;
+
+    if (next <= fp || (uintptr_t)next - (uintptr_t)fp > PROFILE_MAX_FRAME ||
+        ((uintptr_t)next & (sizeof(uintptr_t) - 1)))
+      break;
+    if ((uintptr_t)fp < stack_bottom && (uintptr_t)next >= stack_bottom)
+      break; // Off the top of the main thread's stack
+    fp = next;
   }
+  return depth;
+}
+
+static __attribute__((noinline)) void record_sample(struct block_meta *block) {
+  // A thread's first allocation only seeds its generator
+  if (!sample_seed) {
+    sample_seed = ((uintptr_t)&sample_seed ^ (uintptr_t)block) | 1;
+    sample_countdown = next_sample_interval();
+    return;
+  }
+  sample_countdown = next_sample_interval();
+
+  uintptr_t pcs[PROFILE_MAX_DEPTH + 2];
+  int depth = capture_backtrace(pcs, PROFILE_MAX_DEPTH + 2);
+
+  pthread_mutex_lock(&profile_lock);
+  if (sample_count == MAX_SAMPLES || !samples) {
+    samples_dropped++;
+    pthread_mutex_unlock(&profile_lock);
+    return;
+  }
+
+  // Skip capture_backtrace's return into this function and ours into the
+  // allocator: the first recorded frame is the allocation site
+  struct heap_sample *s = &samples[sample_count];
+  s->block = block;
+  s->size = block->size;
+  s->weight = sample_weight(block->size, profile_rate);
+  s->depth = depth > 2 ? depth - 2 : 0;
+  memcpy(s->pcs, pcs + 2, (size_t)s->depth * sizeof(uintptr_t));
+
+  block->flags = (block->flags & ~BLOCK_SAMPLE_BITS) | BLOCK_SAMPLED |
+                 (int)(sample_count << BLOCK_SAMPLE_SHIFT);
+  sample_count++;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// Forget the sample of a block that is being freed or swept: the last
+// entry moves into its slot, and that block's index is updated
+static void drop_sample(struct block_meta *block) {
+  pthread_mutex_lock(&profile_lock);
+  size_t i = BLOCK_SAMPLE(block);
+  block->flags &= ~BLOCK_SAMPLE_BITS;
+
+  if (i < sample_count && samples[i].block == block) {
+    sample_count--;
+    if (i != sample_count) {
+      samples[i] = samples[sample_count];
+      struct block_meta *moved = samples[i].block;
+      moved->flags = (moved->flags & ~BLOCK_SAMPLE_BITS) | BLOCK_SAMPLED |
+                     (int)(i << BLOCK_SAMPLE_SHIFT);
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
 }
 
 // ========== UTILITY FUNCTIONS ==========
@@ -436,11 +3768,328 @@ int count_free_blocks(void) {
   return count;
 }
 
+double heap_fragmentation(void) {
+  size_t total = 0, largest = 0;
+
+  for (struct block_meta *curr = global_base; curr; curr = curr->next) {
+    if (curr->free) {
+      total += curr->size;
+      if (curr->size > largest)
+        largest = curr->size;
+    }
+  }
+
+  return total ? 1.0 - (double)largest / (double)total : 0.0;
+}
+
 void print_gc_stats(void) {
   printf("  [Allocated: %d blocks | Free: %d blocks]\n",
          count_allocated_blocks(), count_free_blocks());
 }
 
+static void snap_flush(struct snapshot_writer *w) {
+  size_t done = 0;
+  while (done < w->len && !w->failed) {
+    ssize_t n = write(w->fd, w->buf + done, w->len - done);
+    if (n <= 0)
+      w->failed = 1;
+    else
+      done += (size_t)n;
+  }
+  w->len = 0;
+}
+
+static void snap_byte(struct snapshot_writer *w, unsigned char byte) {
+  if (w->len == SNAPSHOT_BUFFER)
+    snap_flush(w);
+  w->buf[w->len++] = byte;
+}
+
+static void snap_varint(struct snapshot_writer *w, uint64_t value) {
+  while (value >= 0x80) {
+    snap_byte(w, (unsigned char)(value | 0x80));
+    value >>= 7;
+  }
+  snap_byte(w, (unsigned char)value);
+}
+
+// Signed deltas, zigzag encoded so small negative values stay short
+static void snap_delta(struct snapshot_writer *w, int64_t delta) {
+  snap_varint(w, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+// The visitor interface of scan_block has no context argument
+static struct snapshot_writer *snap_current = NULL;
+
+static void snap_flush_targets(struct snapshot_writer *w) {
+  if (!w->target_count)
+    return;
+  snap_varint(w, w->target_count);
+  for (size_t i = 0; i < w->target_count; i++) {
+    snap_delta(w, (int64_t)(w->targets[i] - w->block_addr));
+  }
+  w->target_count = 0;
+}
+
+// Address of the record `value` points into: a block's payload, or the
+// allocated small-page object containing it. 0 for anything else.
+static uintptr_t snap_target(uintptr_t value) {
+  struct block_meta *target =
+      lookup_interior(block_index, block_index_count, value);
+  if (!target)
+    return 0;
+  if (target->magic != SMALL_PAGE_MAGIC)
+    return (uintptr_t)(target + 1);
+
+  struct small_page *page = (struct small_page *)(target + 1);
+  long i = small_index(page, value);
+  if (i < 0 || !((page->alloc[i / 64] >> (i % 64)) & 1))
+    return 0;
+  return (uintptr_t)page + SMALL_FIRST_OBJECT + (uintptr_t)i * page->obj_size;
+}
+
+static void snap_pointer(uintptr_t *slot, int precise) {
+  (void)precise;
+  struct snapshot_writer *w = snap_current;
+  uintptr_t target = snap_target(*slot);
+  if (!target)
+    return;
+
+  if (w->target_count == sizeof(w->targets) / sizeof(w->targets[0]))
+    snap_flush_targets(w);
+  w->targets[w->target_count++] = target;
+}
+
+static void snap_roots(struct snapshot_writer *w, int kind, uintptr_t *start,
+                       uintptr_t *end) {
+  for (uintptr_t *p = start; p < end; p++) {
+    uintptr_t target = snap_target(*p);
+    if (!target)
+      continue;
+    snap_byte(w, SNAP_ROOT);
+    snap_byte(w, (unsigned char)kind);
+    snap_varint(w, (uintptr_t)p);
+    snap_varint(w, target);
+    w->roots++;
+  }
+}
+
+// One record per allocated object of a small page, scanned conservatively
+// like scan_heap does. The page header and free slots are not data.
+static uintptr_t snap_page(struct snapshot_writer *w, struct block_meta *block,
+                           uintptr_t prev, int with_pointers) {
+  struct small_page *page = (struct small_page *)(block + 1);
+  for (int i = 0; i < page->count; i++) {
+    uint64_t bit = (uint64_t)1 << (i % 64);
+    if (!(page->alloc[i / 64] & bit))
+      continue;
+
+    uintptr_t addr =
+        (uintptr_t)page + SMALL_FIRST_OBJECT + (uintptr_t)i * page->obj_size;
+    int marked = (page->mark[i / 64] & bit) != 0;
+    unsigned flags = (page->atomic ? BLOCK_ATOMIC : 0) |
+                     (page->old[i / 64] & bit ? BLOCK_OLD : 0);
+    snap_byte(w, SNAP_BLOCK);
+    snap_varint(w, addr - prev);
+    snap_varint(w, page->obj_size);
+    snap_byte(w, (unsigned char)(marked << 1));
+    snap_varint(w, flags);
+
+    if (with_pointers && !page->atomic) {
+      w->block_addr = addr;
+      uintptr_t *words = (uintptr_t *)addr;
+      for (size_t k = 0; k < page->obj_size / sizeof(uintptr_t); k++)
+        snap_pointer(&words[k], 0);
+      snap_flush_targets(w);
+    }
+    snap_varint(w, 0); // End of pointer chunks
+
+    prev = addr;
+    w->blocks++;
+  }
+  return prev;
+}
+
+// Stream every block (address, size, state, flags and, optionally, the
+// blocks it points to) plus all root references into `path`. Each object
+// of a small page is a record of its own. Built for offline analysis of
+// large heaps with heap_reader.
+int gc_heap_snapshot(const char *path, int with_pointers) {
+  struct snapshot_writer w = {0};
+
+  w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w.fd < 0)
+    return -1;
+  w.buf = mmap(NULL, SNAPSHOT_BUFFER, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (w.buf == MAP_FAILED) {
+    close(w.fd);
+    return -1;
+  }
+
+  // Lookups below need the index that gc() normally builds
+  if (global_base)
+    build_block_index();
+
+  for (const char *m = SNAPSHOT_MAGIC; *m; m++)
+    snap_byte(&w, (unsigned char)*m);
+  snap_varint(&w, SNAPSHOT_VERSION);
+  snap_varint(&w, sizeof(uintptr_t));
+  snap_varint(&w, (uintptr_t)global_base);
+
+  uintptr_t prev = 0;
+  snap_current = &w;
+  for (struct block_meta *b = global_base; b != NULL; b = b->next) {
+    if (b->magic == SMALL_PAGE_MAGIC) {
+      prev = snap_page(&w, b, prev, with_pointers);
+      continue;
+    }
+
+    uintptr_t addr = (uintptr_t)(b + 1);
+    snap_byte(&w, SNAP_BLOCK);
+    snap_varint(&w, addr - prev);
+    snap_varint(&w, b->size);
+    snap_byte(&w, (unsigned char)(b->free | (b->marked << 1)));
+    snap_varint(&w, (unsigned)b->flags);
+
+    if (with_pointers && !b->free) {
+      w.block_addr = addr;
+      scan_block(b, snap_pointer);
+      snap_flush_targets(&w);
+    }
+    snap_varint(&w, 0); // End of pointer chunks
+
+    prev = addr;
+    w.blocks++;
+  }
+  snap_current = NULL;
+
+  if (global_base) {
+    for (int i = 0; i < data_segment_count; i++) {
+      snap_roots(&w, SNAP_ROOT_DATA, data_segments[i].start,
+                 data_segments[i].end);
+    }
+    snap_roots(&w, SNAP_ROOT_STACK,
+               (uintptr_t *)__builtin_frame_address(0),
+               (uintptr_t *)stack_bottom);
+    for (int i = 0; i < root_range_count; i++) {
+      snap_roots(&w, SNAP_ROOT_REGISTERED, root_ranges[i].start,
+                 root_ranges[i].end);
+    }
+    snap_roots(&w, SNAP_ROOT_HANDLE, (uintptr_t *)handles,
+               (uintptr_t *)(handles + handle_count));
+  }
+
+  snap_byte(&w, SNAP_END);
+  snap_varint(&w, w.blocks);
+  snap_varint(&w, w.roots);
+  snap_flush(&w);
+
+  munmap(w.buf, SNAPSHOT_BUFFER);
+  if (close(w.fd) != 0)
+    w.failed = 1;
+  return w.failed ? -1 : 0;
+}
+
+static void snap_text(struct snapshot_writer *w, const char *text) {
+  while (*text)
+    snap_byte(w, (unsigned char)*text++);
+}
+
+// Name of the function containing `pc` for folded output. dladdr only
+// knows exported symbols (link with -rdynamic); others print as
+// module+offset for addr2line.
+static void profile_symbol(char *out, size_t len, uintptr_t pc) {
+  Dl_info info = {0}; // dladdr leaves it untouched when it fails
+  int found = dladdr((void *)(pc - 1), &info);
+  if (found && info.dli_sname) {
+    snprintf(out, len, "%s", info.dli_sname);
+  } else if (found && info.dli_fname) {
+    const char *base = strrchr(info.dli_fname, '/');
+    snprintf(out, len, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+             (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+  } else {
+    snprintf(out, len, "0x%lx", (unsigned long)pc);
+  }
+}
+
+// Write the live samples to `path`. GC_PROFILE_PPROF is the text heap
+// profile pprof reads (it scales samples by the rate in the header);
+// GC_PROFILE_FOLDED gives one "outer;...;inner bytes" line per sample with
+// the estimated bytes, ready for flamegraph.pl.
+int gc_profile_write(const char *path, int format) {
+  struct snapshot_writer w = {0};
+  char line[256];
+
+  w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w.fd < 0)
+    return -1;
+  w.buf = mmap(NULL, SNAPSHOT_BUFFER, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (w.buf == MAP_FAILED) {
+    close(w.fd);
+    return -1;
+  }
+
+  pthread_mutex_lock(&profile_lock);
+  if (format == GC_PROFILE_PPROF) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < sample_count; i++)
+      bytes += samples[i].size;
+    snprintf(line, sizeof(line),
+             "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+             sample_count, bytes, sample_count, bytes,
+             profile_rate ? profile_rate : (size_t)PROFILE_DEFAULT_RATE);
+    snap_text(&w, line);
+
+    for (size_t i = 0; i < sample_count; i++) {
+      struct heap_sample *s = &samples[i];
+      snprintf(line, sizeof(line), "1: %zu [1: %zu] @", s->size, s->size);
+      snap_text(&w, line);
+      for (int d = 0; d < s->depth; d++) {
+        snprintf(line, sizeof(line), " 0x%lx", (unsigned long)s->pcs[d]);
+        snap_text(&w, line);
+      }
+      snap_byte(&w, '\n');
+    }
+  } else {
+    for (size_t i = 0; i < sample_count; i++) {
+      struct heap_sample *s = &samples[i];
+      for (int d = s->depth; d-- > 0;) {
+        profile_symbol(line, sizeof(line), s->pcs[d]);
+        snap_text(&w, line);
+        if (d)
+          snap_byte(&w, ';');
+      }
+      snprintf(line, sizeof(line), "%s %zu\n", s->depth ? "" : "[unknown]",
+               s->weight);
+      snap_text(&w, line);
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+
+  // pprof maps the addresses back to binaries through the process maps
+  if (format == GC_PROFILE_PPROF) {
+    snap_text(&w, "\nMAPPED_LIBRARIES:\n");
+    snap_flush(&w);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+      ssize_t n;
+      while ((n = read(maps, w.buf, SNAPSHOT_BUFFER)) > 0) {
+        w.len = (size_t)n;
+        snap_flush(&w);
+      }
+      close(maps);
+    }
+  }
+  snap_flush(&w);
+
+  munmap(w.buf, SNAPSHOT_BUFFER);
+  if (close(w.fd) != 0)
+    w.failed = 1;
+  return w.failed ? -1 : 0;
+}
+
 void debug_heap(void) {
   struct block_meta *curr = global_base;
   printf("\n[HEAP DUMP]\n");
@@ -451,7 +4100,8 @@ void debug_heap(void) {
   while (curr && count < 20) {
     // Validate magic before accessing
     if (curr->magic != 0x12345678 && curr->magic != 0x77777777 &&
-        curr->magic != 0x22222222 && curr->magic != 0x55555555) {
+        curr->magic != 0x22222222 && curr->magic != 0x55555555 &&
+        curr->magic != POOL_FREE_MAGIC && curr->magic != SMALL_PAGE_MAGIC) {
       printf("%-18p [CORRUPTED - magic: 0x%x]\n", (void *)curr, curr->magic);
       break;
     }